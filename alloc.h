@@ -6,6 +6,11 @@ namespace pbbs {
 }
 
 #include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
 #include <vector>
 #include <new>
 #include "utilities.h"
@@ -13,7 +18,12 @@ namespace pbbs {
 #include "utilities.h"
 #include "block_allocator.h"
 #include "memory_size.h"
+#include "huge_pages.h"
+#include "memory_placement.h"
 #include "get_time.h"
+#if defined(__unix__)
+#include <sys/resource.h>
+#endif
 
 namespace pbbs {
 
@@ -26,59 +36,330 @@ namespace pbbs {
   //    pool_allocator
   // ****************************************
 
+  // A snapshot of a pool_allocator's counters, from stats().  All in bytes.
+  struct allocator_stats {
+    struct size_class {
+      size_t size;      // of each block
+      size_t allocated; // taken from the system
+      size_t in_use;    // handed out and not yet freed
+      size_t cached;    // free in the pool, including thread local lists
+      size_t peak;      // most in use or cached by threads (the blocks
+                        // taken from the shared pool) since reset_peak
+    };
+
+    std::vector<size_class> classes;
+    size_t direct_in_use = 0; // mapped exactly, beyond the largest class
+    size_t direct_peak = 0;
+    size_t mapped = 0;        // all taken from the system
+    // free blocks cached by each worker, the last entry being the
+    // list shared by threads outside the pool
+    std::vector<size_t> thread_cached;
+
+    size_t in_use() const {
+      size_t r = direct_in_use;
+      for (auto &c : classes) r += c.in_use;
+      return r;
+    }
+
+    size_t held() const {
+      size_t r = 0;
+      for (size_t b : thread_cached) r += b;
+      return r;
+    }
+
+    // The most of in_use() + held() since reset_peak, which is where
+    // it starts.  Only the shared pools are counted on every allocate
+    // and free, so blocks cached by threads are included.  An upper
+    // bound, since the classes need not peak at the same time.
+    size_t peak() const {
+      size_t r = direct_peak;
+      for (auto &c : classes) r += c.peak;
+      return r;
+    }
+
+    void print(std::ostream &os = std::cout) const {
+      for (auto &c : classes)
+	if (c.allocated > 0)
+	  os << "size = " << c.size << ", allocated = " << c.allocated / c.size
+	     << ", used = " << c.in_use / c.size << ", peak = " << c.peak / c.size
+	     << std::endl;
+      os << "Direct allocated = " << direct_in_use << std::endl;
+      os << "Total bytes allocated = " << mapped << std::endl;
+      os << "Total bytes used = " << in_use() << std::endl;
+    }
+  };
+
   // Allocates headerless blocks from pools of different sizes.
   // A vector of pool sizes is given to the constructor.
   // Sizes must be at least 8, and must increase.
+  // Finding the pool for a size takes constant time as long as there
+  // are no more than four pools between successive powers of two.
+  // Sizes beyond the largest pool are mapped exactly, and unmapped
+  // when freed.
   // For pools of small blocks (below large_threshold) each thread keeps a
   //   thread local list of elements from each pool using the
   //   block_allocator.
-  // For pools of large blocks there is only one shared pool for each.
+  // For pools of large blocks there is one shared pool for each, and
+  //   each worker keeps up to two freed blocks per size in front of
+  //   them, for blocks of up to 4MB and up to a limit of bytes per
+  //   worker (PBBS_ALLOC_THREAD_CACHE, in MB, default 16, 0 for none).
+  // If huge pages are enabled (see huge_pages.h) large blocks of at
+  // least 2MB, and the lists of small blocks, are on huge pages.
+  // Large blocks from the system are placed on numa nodes as given by
+  // PBBS_NUMA (see memory_placement.h).
+  // Freed large blocks are cached in their pool for reuse, up to a
+  // limit on the cached bytes (PBBS_ALLOC_CACHE_LIMIT, in MB, default
+  // no limit), beyond which they go back to the system.  Pools of large
+  // blocks that have not been allocated from for a while (the decay,
+  // PBBS_ALLOC_DECAY, in seconds, default 10, 0 for never) are emptied
+  // by the large blocks freed next, each releasing up to 16MB of them so
+  // no free waits on unmapping a whole pool, and trim() empties them on
+  // demand.
   struct pool_allocator {
 
   private:
-    static const size_t large_align = 64;
     static const size_t large_threshold = (1 << 20);
+    static const size_t decay_release = (1 << 24); // per free, at most
     size_t num_buckets;
     size_t num_small;
     size_t max_small;
     size_t max_size;
     std::atomic<long> large_allocated{0};
+    std::atomic<size_t> large_cached{0}; // bytes in large_buckets
+    size_t cache_limit;
+    long decay_ns;
+    std::atomic<long> last_trim{0};
   
     concurrent_stack<void*>* large_buckets;
+    std::atomic<long>* large_last_used; // per large bucket, in ns
+
+    // blocks out of the shared pool per large bucket (in use or in a
+    // thread cache), and the most since reset_peak
+    struct use_count {
+      std::atomic<size_t> used{0};
+      std::atomic<size_t> peak{0};
+      void add(size_t n) {
+	pbbs::write_max(&peak, used += n, std::less<size_t>());
+      }
+    };
+    use_count* large_used;
+    use_count direct_used; // in bytes
+
+    // Freed large blocks kept by a worker, taken back without touching
+    // anything shared.  The slots are atomic only so that trim() can
+    // empty them from another thread.
+    static const size_t thread_cache_slots = 2;
+    static const size_t thread_cache_buckets = 16;
+    static const size_t thread_cache_block = (1 << 22);
+    struct thread_cache {
+      std::atomic<size_t> bytes;
+      std::atomic<void*> slots[thread_cache_buckets][thread_cache_slots];
+      char pad[64];
+    };
+    thread_cache* thread_caches; // one per worker
+    size_t num_thread_caches;
+    size_t num_cached_buckets; // the first large buckets, that are cached
+    size_t thread_cache_limit; // bytes per worker
+
+    // first_bucket[quarter_index(n)] is the first bucket that could
+    // hold n, and is followed by at most a few too small
+    std::vector<size_t> first_bucket;
+
+    // A monotone classification of sizes: n itself up to 32, then four
+    // classes between successive powers of two.
+    static size_t quarter_index(size_t n) {
+      if (n <= 32) return n;
+      size_t m = n - 1;
+      size_t k = 63 - __builtin_clzl(m);
+      return 33 + (k - 5) * 4 + ((m >> (k - 2)) & 3);
+    }
+
+    // smallest n in the class of quarter_index i
+    static size_t quarter_min(size_t i) {
+      if (i <= 32) return i;
+      size_t k = (i - 33) / 4 + 5;
+      return (((size_t) 1) << k) + ((i - 33) % 4) * (((size_t) 1) << (k - 2)) + 1;
+    }
+
+    // the bucket for n <= max_size
+    size_t bucket_of(size_t n) {
+      size_t bucket = first_bucket[quarter_index(n)];
+      while (n > sizes[bucket]) bucket++;
+      return bucket;
+    }
+
     struct block_allocator *small_allocators;
     std::vector<size_t> sizes;
+    int num_threads;
 
     void* allocate_large(size_t n) {
 
-      size_t bucket = num_small;
       size_t alloc_size;
 
       if (n <= max_size) {
-	while (n > sizes[bucket]) bucket++;
+	size_t bucket = bucket_of(n);
+	if (bucket - num_small < num_cached_buckets) {
+	  void* p = take_cached(bucket - num_small);
+	  if (p != nullptr) return p;
+	}
+	large_last_used[bucket-num_small].store(now_ns(), std::memory_order_relaxed);
+	large_used[bucket-num_small].add(1);
 	maybe<void*> r = large_buckets[bucket-num_small].pop();
-	if (r) return *r;
+	if (r) {
+	  large_cached -= sizes[bucket];
+	  return *r;
+	}
 	alloc_size = sizes[bucket];
-      } else alloc_size = n;
+      } else {
+	alloc_size = n;
+	direct_used.add(n);
+      }
 
-      void* a = (void*) aligned_alloc(large_align, alloc_size);
-      if (a == NULL) throw std::bad_alloc();
-      
-      large_allocated += n;
+      void* a = alloc_large_block(alloc_size);
+      large_allocated += alloc_size;
       return a;
     }
 
     void deallocate_large(void* ptr, size_t n) {
-      if (n > max_size) { 
-	free(ptr);
-	large_allocated -= n;
+      size_t bucket = (n <= max_size) ? bucket_of(n) : num_small;
+      if (!(n <= max_size && bucket - num_small < num_cached_buckets &&
+	    put_cached(bucket - num_small, ptr)))
+	release_large(bucket, ptr, n);
+      if (decay_ns > 0) {
+	long now = now_ns();
+	long last = last_trim.load(std::memory_order_relaxed);
+	// if not done, the next free carries on
+	if (now - last > decay_ns / 2 &&
+	    last_trim.compare_exchange_strong(last, now) &&
+	    !trim_large(decay_ns, decay_release))
+	  last_trim.store(last, std::memory_order_relaxed);
+      }
+    }
+
+    // returns a block to the shared pool, or to the system
+    void release_large(size_t bucket, void* ptr, size_t n) {
+      if (n > max_size) direct_used.used -= n;
+      else large_used[bucket-num_small].used--;
+      if (n > max_size || large_cached + sizes[bucket] > cache_limit) {
+	size_t size = (n > max_size) ? n : sizes[bucket];
+	free_large_block(ptr, size);
+	large_allocated -= size;
       } else {
-	size_t bucket = num_small;
-	while (n > sizes[bucket]) bucket++;
+	large_cached += sizes[bucket];
 	large_buckets[bucket-num_small].push(ptr);
       }
     }
 
-    const size_t small_alloc_block_size = (1 << 20);
+    thread_cache* my_cache() {
+      int id = worker_id();
+      if (id < 0 || (size_t) id >= num_thread_caches) return nullptr;
+      return &thread_caches[id];
+    }
+
+    void* take_cached(size_t j) {
+      thread_cache* c = my_cache();
+      if (c == nullptr) return nullptr;
+      for (auto &slot : c->slots[j])
+	if (slot.load(std::memory_order_relaxed) != nullptr) {
+	  void* p = slot.exchange(nullptr);
+	  if (p != nullptr) {
+	    c->bytes -= sizes[num_small + j];
+	    return p;
+	  }
+	}
+      return nullptr;
+    }
+
+    bool put_cached(size_t j, void* p) {
+      thread_cache* c = my_cache();
+      size_t size = sizes[num_small + j];
+      if (c == nullptr ||
+	  c->bytes.load(std::memory_order_relaxed) + size > thread_cache_limit)
+	return false;
+      // only the owner fills slots, so no other thread can race for one
+      for (auto &slot : c->slots[j])
+	if (slot.load(std::memory_order_relaxed) == nullptr) {
+	  c->bytes += size;
+	  slot.store(p, std::memory_order_release);
+	  return true;
+	}
+      return false;
+    }
+
+    // returns the blocks in the thread caches to the shared pools
+    void flush_thread_caches() {
+      for (size_t t = 0; t < num_thread_caches; t++)
+	for (size_t j = 0; j < num_cached_buckets; j++)
+	  for (auto &slot : thread_caches[t].slots[j]) {
+	    void* p = slot.exchange(nullptr);
+	    if (p != nullptr) {
+	      thread_caches[t].bytes -= sizes[num_small + j];
+	      release_large(num_small + j, p, sizes[num_small + j]);
+	    }
+	  }
+    }
+
+    // blocks of large bucket j in the thread caches
+    size_t thread_cached_blocks(size_t j) {
+      size_t r = 0;
+      if (j < num_cached_buckets)
+	for (size_t t = 0; t < num_thread_caches; t++)
+	  for (auto &slot : thread_caches[t].slots[j])
+	    if (slot.load() != nullptr) r++;
+      return r;
+    }
+
+    static long now_ns() {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Empties the pools of large blocks not allocated from for age ns,
+    // stopping once at least max_bytes are released.  Returns whether
+    // it got through all of them.
+    bool trim_large(long age, size_t max_bytes = SIZE_MAX) {
+      long now = now_ns();
+      size_t released = 0;
+      for (size_t i = num_small; i < num_buckets; i++) {
+	if (now - large_last_used[i-num_small].load(std::memory_order_relaxed) < age)
+	  continue;
+	maybe<void*> r;
+	while ((r = large_buckets[i-num_small].pop())) {
+	  large_cached -= sizes[i];
+	  large_allocated -= sizes[i];
+	  free_large_block(*r, sizes[i]);
+	  released += sizes[i];
+	  if (released >= max_bytes) return false;
+	}
+      }
+      return true;
+    }
+
+    static size_t env_size(const char* name, size_t dflt) {
+      const char* env = std::getenv(name);
+      return (env == nullptr) ? dflt : (size_t) std::stoull(env);
+    }
+
+    static bool on_huge_pages(size_t n) {
+      return huge_pages() != huge_page_policy::off && n >= huge_page_2mb;
+    }
+
+    // Mapped directly rather than with malloc, which here is set to
+    // never give memory back (see __mallopt below).
+    static void* alloc_large_block(size_t n) {
+      void* a = on_huge_pages(n) ? huge_alloc(n) : map_pages(n);
+      place_memory(a, n, memory_placement::from_environment(), false);
+      return a;
+    }
+
+    static void free_large_block(void* ptr, size_t n) {
+      if (on_huge_pages(n)) huge_free(ptr, n);
+      else unmap_pages(ptr, n);
+    }
+
+    // the lists of small blocks fill a huge page if they are enabled
+    const size_t small_alloc_block_size =
+      (huge_pages() == huge_page_policy::off) ? (1 << 20) : huge_page_2mb;
 
   public:
     ~pool_allocator() {
@@ -87,11 +368,18 @@ namespace pbbs {
       free(small_allocators);
       clear();
       delete[] large_buckets;
+      delete[] large_last_used;
+      delete[] large_used;
+      delete[] thread_caches;
     }
 
     pool_allocator() {}
   
-    pool_allocator(std::vector<size_t> const &sizes) : sizes(sizes) {
+    // threads: the number of workers with their own lists and caches
+    // (default max_workers(), so that it still covers them all after
+    // set_num_workers); other threads share one under a lock
+    pool_allocator(std::vector<size_t> const &sizes, int threads = 0)
+      : sizes(sizes), num_threads((threads > 0) ? threads : max_workers()) {
       timer t;
       num_buckets = sizes.size();
       max_size = sizes[num_buckets-1];
@@ -100,7 +388,32 @@ namespace pbbs {
 	num_small++;
       max_small = (num_small > 0) ? sizes[num_small - 1] : 0;
 
+      first_bucket.resize(quarter_index(max_size) + 1);
+      size_t b = 0;
+      for (size_t i = 0; i < first_bucket.size(); i++) {
+	while (quarter_min(i) > sizes[b]) b++;
+	first_bucket[i] = b;
+      }
+
       large_buckets = new concurrent_stack<void*>[num_buckets-num_small];
+      large_last_used = new std::atomic<long>[num_buckets-num_small];
+      for (size_t i = num_small; i < num_buckets; i++) large_last_used[i-num_small] = 0;
+      large_used = new use_count[num_buckets-num_small];
+      num_cached_buckets = 0;
+      while (num_small + num_cached_buckets < num_buckets &&
+	     num_cached_buckets < thread_cache_buckets &&
+	     sizes[num_small + num_cached_buckets] <= thread_cache_block)
+	num_cached_buckets++;
+      num_thread_caches = num_threads;
+      thread_caches = new thread_cache[num_thread_caches];
+      for (size_t t = 0; t < num_thread_caches; t++) {
+	thread_caches[t].bytes = 0;
+	for (auto &b : thread_caches[t].slots)
+	  for (auto &slot : b) slot = nullptr;
+      }
+      thread_cache_limit = env_size("PBBS_ALLOC_THREAD_CACHE", 16) << 20;
+      cache_limit = env_size("PBBS_ALLOC_CACHE_LIMIT", SIZE_MAX >> 20) << 20;
+      decay_ns = (long) env_size("PBBS_ALLOC_DECAY", 10) * 1000000000l;
 
       small_allocators = (struct block_allocator*)
 	malloc(num_buckets * sizeof(struct block_allocator));
@@ -114,86 +427,204 @@ namespace pbbs {
 	  throw std::invalid_argument("for small_allocator, bucket sizes must increase");
 	prev_bucket_size = bucket_size;
 	new (static_cast<void*>(std::addressof(small_allocators[i]))) 
-	  block_allocator(bucket_size, 0, small_alloc_block_size - 64); 
+	  block_allocator(bucket_size, 0, small_alloc_block_size - 64, 0, num_threads);
       }
     }
 
     void* allocate(size_t n) {
       if (n > max_small) return allocate_large(n);
-      size_t bucket = 0;
-      while (n > sizes[bucket]) bucket++;
-      return small_allocators[bucket].alloc();
+      return small_allocators[bucket_of(n)].alloc();
     }
 
     void deallocate(void* ptr, size_t n) {
+      unplace_memory(ptr, n);
       if (n > max_small) deallocate_large(ptr, n);
       else {
-	size_t bucket = 0;
-	while (n > sizes[bucket]) bucket++;
-	small_allocators[bucket].free(ptr);
+	small_allocators[bucket_of(n)].free(ptr);
       }
     }
 
-    // allocate, touch, and free to make sure space for small blocks is paged in
+    // allocate, touch, and free to make sure space for small blocks is
+    // paged in (one touch per page)
     void reserve(size_t bytes) {
+      size_t page = std::max<size_t>(1 << 12, huge_page_size());
       size_t bc = bytes/small_alloc_block_size;
       std::vector<void*> h(bc);
       parallel_for(0, bc, [&] (size_t i) {
 	  h[i] = allocate(small_alloc_block_size);
 	}, 1);
       parallel_for(0, bc, [&] (size_t i) {
-	  for (size_t j=0; j < small_alloc_block_size; j += (1 << 12))
+	  for (size_t j=0; j < small_alloc_block_size; j += page)
 	    ((char*) h[i])[j] = 0;
 	}, 1);
       for (size_t i=0; i < bc; i++)
       	deallocate(h[i], small_alloc_block_size);
     }
 
-    void print_stats() {
-      size_t total_a = 0;
-      size_t total_u = 0;
+    allocator_stats stats() {
+      allocator_stats r;
+      r.thread_cached.assign(num_threads + 1, 0);
       for (size_t i = 0; i < num_small; i++) {
-	size_t bucket_size = sizes[i];
-	size_t allocated = small_allocators[i].num_allocated_blocks();
-	size_t used = small_allocators[i].num_used_blocks();
-	total_a += allocated * bucket_size;
-	total_u += used * bucket_size;
-	cout << "size = " << bucket_size << ", allocated = " << allocated
-	     << ", used = " << used << endl;
+	block_allocator &a = small_allocators[i];
+	size_t allocated = a.num_allocated_blocks() * sizes[i];
+	size_t used = a.num_used_blocks() * sizes[i];
+	r.classes.push_back({sizes[i], allocated, used, allocated - used,
+	      std::max(a.num_peak_blocks() * sizes[i], used)});
+	for (int t = 0; t <= num_threads; t++)
+	  r.thread_cached[t] += a.num_local_blocks(t) * sizes[i];
       }
-      cout << "Large allocated = " << large_allocated << endl;
-      cout << "Total bytes allocated = " << total_a + large_allocated << endl;
-      cout << "Total bytes used = " << total_u << endl;
+      for (size_t i = num_small; i < num_buckets; i++) {
+	use_count &u = large_used[i-num_small];
+	size_t out = u.used * sizes[i];
+	size_t shared = large_buckets[i-num_small].size() * sizes[i];
+	size_t in_threads = thread_cached_blocks(i-num_small) * sizes[i];
+	r.classes.push_back({sizes[i], out + shared, out - std::min(out, in_threads),
+	      shared + in_threads, u.peak * sizes[i]});
+      }
+      for (size_t t = 0; t < num_thread_caches; t++)
+	r.thread_cached[t] += thread_caches[t].bytes;
+      r.direct_in_use = direct_used.used;
+      r.direct_peak = direct_used.peak;
+      r.mapped = r.direct_in_use;
+      for (auto &c : r.classes) r.mapped += c.allocated;
+      return r;
+    }
+
+    // Starts the high water marks in stats() from what is in use now.
+    void reset_peak() {
+      for (size_t i = 0; i < num_small; i++) small_allocators[i].reset_peak();
+      for (size_t i = num_small; i < num_buckets; i++)
+	large_used[i-num_small].peak = large_used[i-num_small].used.load();
+      direct_used.peak = direct_used.used.load();
     }
 
+    void print_stats() { stats().print(std::cout); }
+
     void clear() {
-      for (size_t i = num_small; i < num_buckets; i++) {
-	maybe<void*> r = large_buckets[i-num_small].pop();
-	while (r) {
-	  large_allocated -= sizes[i];
-	  free(*r);
-	  r = large_buckets[i-num_small].pop();
-	}
-      }
+      flush_thread_caches();
+      trim_large(0);
+    }
+
+    // Returns memory to the system: the cached large blocks not
+    // allocated for at least age_seconds (after emptying the thread
+    // caches into their pools), and the free whole pages inside blocks
+    // of the small pools (see block_allocator::trim, which needs no
+    // other thread to be allocating at the time).
+    void trim(double age_seconds = 0) {
+      flush_thread_caches();
+      trim_large((long) (age_seconds * 1e9));
+      for (size_t i = 0; i < num_small; i++) small_allocators[i].trim();
     }
+
+    // The limit on the bytes of freed large blocks kept for reuse.
+    void set_cache_limit(size_t bytes) { cache_limit = bytes; }
+
+    // How long a pool of large blocks has to go unused before it is
+    // emptied when some large block is freed, 0 for never.
+    void set_decay(double seconds) { decay_ns = (long) (seconds * 1e9); }
+
+    // Bytes held in freed large blocks.
+    size_t cached_bytes() {
+      size_t r = large_cached;
+      for (size_t t = 0; t < num_thread_caches; t++) r += thread_caches[t].bytes;
+      return r;
+    }
+
+    // The limit on the bytes of freed large blocks each worker keeps,
+    // 0 to keep none.
+    void set_thread_cache_limit(size_t bytes) { thread_cache_limit = bytes; }
   };
 
   // ****************************************
-  //    default_allocator (uses powers of two as pool sizes)
+  //    default_allocator (uses quarter powers of two as pool sizes)
   // ****************************************
 
-  // these are bucket sizes used by the default allocator.
-  std::vector<size_t> default_sizes() {
-    size_t log_min_size = 4;
-    size_t log_max_size = pbbs::log2_up(getMemorySize()/64);
-
-    std::vector<size_t> sizes;
-    for (size_t i = log_min_size; i <= log_max_size; i++)
-      sizes.push_back(1 << i);
+  // these are bucket sizes used by the default allocator: 16, 24, and
+  // then four per power of two (32, 40, 48, 56, 64, 80, ...), so at
+  // most a quarter of a block is wasted.  Up to 1GB, or memory/64 if
+  // smaller, beyond which allocations are mapped exactly.
+  inline std::vector<size_t> default_sizes() {
+    size_t log_max_size = std::min<size_t>(30, pbbs::log2_up(getMemorySize()/64));
+
+    std::vector<size_t> sizes = {16, 24};
+    for (size_t i = 5; i < log_max_size; i++)
+      for (size_t j = 0; j < 4; j++)
+	sizes.push_back((((size_t) 1) << i) + j * (((size_t) 1) << (i - 2)));
+    sizes.push_back(((size_t) 1) << log_max_size);
     return sizes;
   }
 
-  pool_allocator default_allocator(default_sizes());
+  // The default allocator is created on first use rather than before
+  // main, so programs that do not allocate from it do not pay for it.
+  // configure_default_allocator changes its bucket sizes or number of
+  // threads (default max_workers()), e.g. at the start of main, and
+  // returns false if it is too late because it is already in use.
+  // It is never destroyed, so it can still be used by destructors of
+  // static objects.
+
+  namespace internal {
+    struct default_allocator_config {
+      std::vector<size_t> sizes; // empty for default_sizes()
+      int threads = 0;
+      bool created = false;
+    };
+
+    inline default_allocator_config& default_config() {
+      static default_allocator_config config;
+      return config;
+    }
+
+    inline std::mutex& default_config_lock() {
+      static std::mutex lock;
+      return lock;
+    }
+  }
+
+  inline pool_allocator& default_pool_allocator() {
+    static pool_allocator* pool = [] () {
+      std::lock_guard<std::mutex> lock(internal::default_config_lock());
+      internal::default_allocator_config &c = internal::default_config();
+      c.created = true;
+      return new pool_allocator(c.sizes.empty() ? default_sizes() : c.sizes,
+				c.threads);
+    }();
+    return *pool;
+  }
+
+  inline bool configure_default_allocator(std::vector<size_t> const &sizes,
+					  int threads = 0) {
+    std::lock_guard<std::mutex> lock(internal::default_config_lock());
+    internal::default_allocator_config &c = internal::default_config();
+    if (c.created) return false;
+    c.sizes = sizes;
+    c.threads = threads;
+    return true;
+  }
+
+  // Forwards to default_pool_allocator(), so that default_allocator.f()
+  // works as it did when it was a global pool_allocator.  It has no
+  // state, so each translation unit can have its own.
+  struct default_allocator_ref {
+    void* allocate(size_t n) const {
+      return default_pool_allocator().allocate(n); }
+    void deallocate(void* ptr, size_t n) const {
+      default_pool_allocator().deallocate(ptr, n); }
+    void reserve(size_t bytes) const { default_pool_allocator().reserve(bytes); }
+    void clear() const { default_pool_allocator().clear(); }
+    void trim() const { default_pool_allocator().trim(); }
+    void print_stats() const { default_pool_allocator().print_stats(); }
+    allocator_stats stats() const { return default_pool_allocator().stats(); }
+    void reset_peak() const { default_pool_allocator().reset_peak(); }
+    size_t cached_bytes() const { return default_pool_allocator().cached_bytes(); }
+    void set_cache_limit(size_t bytes) const {
+      default_pool_allocator().set_cache_limit(bytes); }
+    void set_decay(double seconds) const {
+      default_pool_allocator().set_decay(seconds); }
+    void set_thread_cache_limit(size_t bytes) const {
+      default_pool_allocator().set_thread_cache_limit(bytes); }
+  };
+
+  static constexpr default_allocator_ref default_allocator{};
 
   // ****************************************
   // Following Matches the c++ Allocator specification (minimally)
@@ -275,12 +706,22 @@ namespace pbbs {
     }
   };
 
-  __mallopt __mallopt_var;
+  static __mallopt __mallopt_var;
   
   inline void* my_alloc(size_t i) {return malloc(i);}
-  inline void my_free(void* p) {free(p);}
-  void allocator_clear() {}
-  void allocator_reserve(size_t bytes) {}
+  inline void my_free(void* p) {
+    unplace_memory(p, 0);
+    free(p);
+  }
+  inline void allocator_clear() {}
+  inline void allocator_reserve(size_t) {}
+
+  // gives memory that is not in use back to the system, when no other
+  // thread is allocating (see pool_allocator::trim)
+  inline void allocator_trim() {
+    default_allocator.trim();
+    malloc_trim(0);
+  }
 
 #else
 
@@ -292,7 +733,7 @@ namespace pbbs {
   }
 
   // allocates and tags with a header (8, 16 or 64 bytes) that contains the size
-  void* my_alloc(size_t n) {
+  inline void* my_alloc(size_t n) {
     size_t hsize = header_size(n);
     void* ptr;
     ptr = default_allocator.allocate(n + hsize);
@@ -302,7 +743,7 @@ namespace pbbs {
   }
 
   // reads the size, offsets the header and frees
-  void my_free(void *ptr) {
+  inline void my_free(void *ptr) {
     size_t n = *(((size_t*) ptr)-size_offset);
     size_t hsize = header_size(n);
     if (hsize > (1ul << 48)) {
@@ -312,14 +753,62 @@ namespace pbbs {
     default_allocator.deallocate((void*) (((char*) ptr) - hsize), n + hsize);
   }
 
-  void allocator_clear() {
+  inline void allocator_clear() {
     default_allocator.clear();
   }
 
-  void allocator_reserve(size_t bytes) {
+  inline void allocator_reserve(size_t bytes) {
     default_allocator.reserve(bytes);
   }
+
+  // gives memory that is not in use back to the system, when no other
+  // thread is allocating (see pool_allocator::trim)
+  inline void allocator_trim() {
+    default_allocator.trim();
+  }
+#endif
+
+  // ****************************************
+  //    resident memory of the process
+  // ****************************************
+
+  namespace internal {
+    // a "<name>: <n> kB" line of /proc/self/status, in bytes
+    inline size_t proc_status_bytes(std::string name) {
+      std::ifstream in("/proc/self/status");
+      std::string line;
+      while (std::getline(in, line))
+	if (line.compare(0, name.size() + 1, name + ":") == 0)
+	  return std::stoull(line.substr(name.size() + 1)) * 1024;
+      return 0;
+    }
+  }
+
+  // bytes of memory resident now (0 where not known)
+  inline size_t current_rss() {
+    return internal::proc_status_bytes("VmRSS");
+  }
+
+  // the most bytes resident at once, since the start or reset_peak_rss
+  inline size_t peak_rss() {
+    size_t r = internal::proc_status_bytes("VmHWM");
+#if defined(__unix__)
+    if (r == 0) {
+      struct rusage u;
+      getrusage(RUSAGE_SELF, &u);
+      r = (size_t) u.ru_maxrss * 1024;
+    }
 #endif
+    return r;
+  }
+
+  // Restarts peak_rss from the current resident memory, so it can be
+  // taken around a region.  Returns false if not supported (Linux only).
+  inline bool reset_peak_rss() {
+    std::ofstream out("/proc/self/clear_refs");
+    out << "5" << std::flush;
+    return out.good();
+  }
 
   // ****************************************
   //    common across allocators (key routines used by sequences)
@@ -331,6 +820,14 @@ namespace pbbs {
     return (E*) my_alloc(n * sizeof(E));
   }
 
+  // As above, with the pages placed on numa nodes as given
+  template<typename E>
+  E* new_array_no_init(size_t n, memory_placement m) {
+    E* r = new_array_no_init<E>(n);
+    place_memory(r, n * sizeof(E), m);
+    return r;
+  }
+
   // Initializes in parallel
   template<typename E>
   E* new_array(size_t n) {
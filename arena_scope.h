@@ -0,0 +1,135 @@
+#pragma once
+
+// A bump allocator for the temporaries of a phase of an algorithm.
+// While an arena_scope is alive, sequences whose allocator is
+// pbbs::arena_allocator take their memory from it, e.g.
+//   {
+//     pbbs::arena_scope scope;
+//     for (int round = 0; round < rounds; round++) {
+//       pbbs::sequence<long, pbbs::arena_allocator<long>> tmp(n, f);
+//       ...
+//     }
+//   } // all of it is freed here
+// Each worker bumps a pointer in its own chunk, so allocating takes no
+// atomics and freeing does nothing; the chunks go back to the pool
+// allocator when the scope exits.  Threads that are not workers share
+// one extra chunk under a lock.
+// Scopes nest, allocations going to the innermost one, and are opened
+// and closed by one thread at a time (typically around a phase, not
+// inside a parallel loop).  Nothing allocated in a scope may be used
+// after it exits, and arena_allocator throws std::bad_alloc outside of
+// any scope.
+
+#include <mutex>
+#include <new>
+#include <vector>
+#include "utilities.h"
+#include "alloc.h"
+
+namespace pbbs {
+
+  class arena_scope {
+  public:
+    static constexpr size_t default_chunk_size = 1 << 20;
+
+    // chunk_size: the bytes each worker takes from the pool allocator
+    // at a time.  Requests over a quarter of it get a chunk of their own.
+    arena_scope(size_t chunk_size = default_chunk_size)
+      : chunk_size(chunk_size), outer(current()),
+	workers(num_workers()), locals(new local[workers + 1]) {
+      current() = this;
+    }
+
+    ~arena_scope() {
+      current() = outer;
+      for (int i = 0; i <= workers; i++)
+	for (auto &c : locals[i].chunks)
+	  default_allocator.deallocate(c.first, c.second);
+      delete[] locals;
+    }
+
+    arena_scope(const arena_scope&) = delete;
+    arena_scope& operator = (const arena_scope&) = delete;
+
+    // the innermost live scope, or nullptr
+    static arena_scope* innermost() { return current(); }
+
+    void* allocate(size_t n) {
+      int id = worker_id();
+      if (id >= 0 && id < workers) return allocate_local(locals[id], n);
+      std::lock_guard<std::mutex> lock(external_lock);
+      return allocate_local(locals[workers], n);
+    }
+
+    // Bytes taken from the pool allocator so far, which is at most
+    // what was allocated plus a chunk per worker.
+    size_t bytes_reserved() {
+      size_t total = 0;
+      for (int i = 0; i <= workers; i++)
+	for (auto &c : locals[i].chunks) total += c.second;
+      return total;
+    }
+
+  private:
+    static constexpr size_t align = 16;
+
+    // padded since new[] does not align to cache lines before c++17
+    struct local {
+      char* next = nullptr;
+      char* end = nullptr;
+      std::vector<std::pair<void*, size_t>> chunks;
+      char pad[64];
+    };
+
+    // a function local static so the header can go in several
+    // translation units
+    static arena_scope*& current() {
+      static arena_scope* s = nullptr;
+      return s;
+    }
+
+    size_t chunk_size;
+    arena_scope* outer;
+    int workers;
+    local* locals;
+    std::mutex external_lock;
+
+    char* new_chunk(local &l, size_t n) {
+      char* c = (char*) default_allocator.allocate(n);
+      l.chunks.push_back(std::make_pair((void*) c, n));
+      return c;
+    }
+
+    void* allocate_local(local &l, size_t n) {
+      n = (n + align - 1) / align * align;
+      if (n > chunk_size / 4) return new_chunk(l, n);
+      if (l.next + n > l.end) {
+	l.next = new_chunk(l, chunk_size);
+	l.end = l.next + chunk_size;
+      }
+      char* r = l.next;
+      l.next += n;
+      return r;
+    }
+  };
+
+  // Matches the c++ Allocator specification, as pbbs::allocator does.
+  template <typename T>
+  struct arena_allocator {
+    using value_type = T;
+    T* allocate(size_t n) {
+      arena_scope* s = arena_scope::innermost();
+      if (s == nullptr) throw std::bad_alloc();
+      return (T*) s->allocate(n * sizeof(T));
+    }
+    void deallocate(T*, size_t) {}
+
+    arena_allocator() = default;
+    template <class U> constexpr arena_allocator(const arena_allocator<U>&) {}
+  };
+
+  template <class T, class U>
+  bool operator==(const arena_allocator<T>&, const arena_allocator<U>&) { return true; }
+  template <class T, class U>
+  bool operator!=(const arena_allocator<T>&, const arena_allocator<U>&) { return false; }
+}
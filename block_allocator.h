@@ -24,6 +24,10 @@
 // Keeps a local pool per processor
 // Grabs list_size elements from a global pool if empty, and
 // Returns list_size elements to the global pool when local pool=2*list_size
+// Threads that are not workers (worker_id() < 0), or beyond the number
+// of threads given to the constructor (default max_workers()), share
+// one extra local pool under a lock.
+// Blocks are carved from huge pages if enabled (see huge_pages.h).
 // Keeps track of number of allocated elements.
 // Probably more efficient than a general purpose allocator
 
@@ -33,15 +37,22 @@
 #include <stdlib.h>
 #include <math.h>
 #include <atomic>
+#include <mutex>
 #include "concurrent_stack.h"
 #include "utilities.h"
 #include "memory_size.h"
+#include "huge_pages.h"
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 struct block_allocator {
 private:
 
   static const size_t default_list_bytes = (1 << 22) - 64; // in bytes
   static const size_t pad_size = 256;
+  static const size_t huge_header = 64; // holds the size, for clear()
 
   struct block {
     block* next;
@@ -62,39 +73,57 @@ private:
   block_p get_list();
   concurrent_stack<char*> pool_roots;
   concurrent_stack<block_p> global_stack;
-  thread_list* local_lists;
+  thread_list* local_lists; // one per worker, then one for other threads
+  static std::mutex& external_lock() {
+    static std::mutex m;
+    return m;
+  }
 
   size_t list_length;
   size_t max_blocks;
   size_t block_size_;
   //std::atomic<size_t> blocks_allocated;
   size_t blocks_allocated;
+  size_t blocks_out;  // on lists taken from the global pool by threads
+  size_t peak_out;    // most blocks_out since reset_peak
   char* allocate_blocks(size_t num_blocks);
+  void free_blocks(char* start);
+  void* alloc_local(thread_list &l);
+  void free_local(thread_list &l, void* ptr);
 
 public:
-  static int thread_count;
+  int thread_count; // workers with their own list
   void* alloc();
   void free(void*);
   void reserve(size_t n);
   void clear();
+  void trim();
   void print_stats();
   size_t block_size () {return block_size_;}
   size_t num_allocated_blocks() {return blocks_allocated;}
   size_t num_used_blocks();
 
+  // The most blocks taken from the global pool at once since the last
+  // reset_peak, whether in use or cached on a thread's list.  Tracked
+  // when whole lists move, so costs nothing per alloc or free.
+  size_t num_peak_blocks() {return peak_out;}
+  void reset_peak() {peak_out = blocks_out;}
+
+  // free blocks cached by worker i (thread_count for other threads)
+  size_t num_local_blocks(int i) {return local_lists[i].sz;}
+
   ~block_allocator();
   block_allocator(size_t block_size,
 		  size_t reserved_blocks = 0, 
 		  size_t list_length_ = 0, 
-		  size_t max_blocks_ = 0);
+		  size_t max_blocks_ = 0,
+		  int threads = 0);
   block_allocator() {};
 };
 
-int block_allocator::thread_count = num_workers();
-
 // Allocate a new list of list_length elements
 
-auto block_allocator::initialize_list(block_p start) -> block_p {
+inline auto block_allocator::initialize_list(block_p start) -> block_p {
   parallel_for (0, list_length - 1, [&] (size_t i) {
       block_p p =  (block_p) (((char*) start) + i * block_size_);
       p->next = (block_p) (((char*) p) + block_size_);
@@ -104,17 +133,23 @@ auto block_allocator::initialize_list(block_p start) -> block_p {
   return start;
 }
 
-size_t block_allocator::num_used_blocks() {
+inline size_t block_allocator::num_used_blocks() {
   size_t free_blocks = global_stack.size()*list_length;
-  for (int i = 0; i < thread_count; ++i) 
+  for (int i = 0; i <= thread_count; ++i) 
     free_blocks += local_lists[i].sz;
   return blocks_allocated - free_blocks;
 }
 
-auto block_allocator::allocate_blocks(size_t num_blocks) -> char* {
+inline auto block_allocator::allocate_blocks(size_t num_blocks) -> char* {
   //char* start = (char*) aligned_alloc(pad_size,
   //num_blocks * block_size_+ pad_size);
-  char* start = (char*) pbbs::my_alloc(num_blocks * block_size_);
+  size_t bytes = num_blocks * block_size_;
+  char* start;
+  if (pbbs::huge_pages() != pbbs::huge_page_policy::off) {
+    char* p = (char*) pbbs::huge_alloc(bytes + huge_header);
+    *((size_t*) p) = bytes + huge_header;
+    start = p + huge_header;
+  } else start = (char*) pbbs::my_alloc(bytes);
   if (start == NULL) {
     fprintf(stderr, "Cannot allocate space in block_allocator");
     exit(1); }
@@ -129,9 +164,18 @@ auto block_allocator::allocate_blocks(size_t num_blocks) -> char* {
   return start;
 }
 
+inline void block_allocator::free_blocks(char* start) {
+  if (pbbs::huge_pages() != pbbs::huge_page_policy::off) {
+    char* p = start - huge_header;
+    pbbs::huge_free(p, *((size_t*) p));
+  } else pbbs::my_free(start);
+}
+
 // Either grab a list from the global pool, or if there is none
 // then allocate a new list
-auto block_allocator::get_list() -> block_p {
+inline auto block_allocator::get_list() -> block_p {
+  size_t out = pbbs::fetch_and_add(&blocks_out, list_length) + list_length;
+  pbbs::write_max(&peak_out, out, std::less<size_t>());
   maybe<block_p> rem = global_stack.pop();
   if (rem) return *rem;
   block_p start = (block_p) allocate_blocks(list_length);
@@ -139,7 +183,7 @@ auto block_allocator::get_list() -> block_p {
 }
 
 // Allocate n elements across however many lists are needed (rounded up)
-void block_allocator::reserve(size_t n) {
+inline void block_allocator::reserve(size_t n) {
   size_t num_lists = thread_count + ceil(n / (double)list_length);
   char* start = allocate_blocks(list_length*num_lists);
   parallel_for(0, num_lists, [&] (size_t i) {
@@ -148,7 +192,31 @@ void block_allocator::reserve(size_t n) {
     });
 }
 
-void block_allocator::print_stats() {
+// Returns the whole pages inside the blocks on the global lists to the
+// system (the first word of each block holds the list, so only blocks
+// of at least two pages have any).  They are faulted back in as zeros
+// when reused.  Lists held by threads are left alone.
+// The lists are off the global pool while their pages are returned, so
+// call this when no other thread is allocating from it (e.g. between
+// phases): otherwise they find the pool empty and take fresh memory.
+inline void block_allocator::trim() {
+#if defined(__linux__)
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  if (block_size_ < 2 * page) return;
+  std::vector<block_p> lists;
+  maybe<block_p> l;
+  while ((l = global_stack.pop())) lists.push_back(*l);
+  for (block_p b : lists)
+    for (; b != NULL; b = b->next) {
+      size_t start = ((size_t) (b + 1) + page - 1) / page * page;
+      size_t end = ((size_t) b + block_size_) / page * page;
+      if (end > start) madvise((void*) start, end - start, MADV_DONTNEED);
+    }
+  for (block_p b : lists) global_stack.push(b);
+#endif
+}
+
+inline void block_allocator::print_stats() {
   size_t used = num_used_blocks();
   size_t allocated = num_allocated_blocks();
   size_t size = block_size();
@@ -157,11 +225,14 @@ void block_allocator::print_stats() {
 	    << ", bytes: " << size*allocated << std::endl;
 }
 
-block_allocator::block_allocator(size_t block_size,
+inline block_allocator::block_allocator(size_t block_size,
 				 size_t reserved_blocks,
 				 size_t list_length_,
-				 size_t max_blocks_) {
+				 size_t max_blocks_,
+				 int threads) {
+  thread_count = (threads > 0) ? threads : max_workers();
   blocks_allocated = 0;
+  blocks_out = peak_out = 0;
   block_size_ = block_size;
   if (list_length_ == 0)
     list_length = default_list_bytes / block_size;
@@ -170,63 +241,79 @@ block_allocator::block_allocator(size_t block_size,
     max_blocks = (3*getMemorySize()/block_size)/4;
   else max_blocks = max_blocks_;
 
-  reserve(reserved_blocks);
+  // lists are otherwise allocated as threads first need them
+  if (reserved_blocks > 0) reserve(reserved_blocks);
 
   // all local lists start out empty
-  local_lists = new thread_list[thread_count];
+  local_lists = new thread_list[thread_count+1];
   initialized = true;
 }
 
-void block_allocator::clear() {
+inline void block_allocator::clear() {
   if (num_used_blocks() > 0) 
     cout << "Warning: not clearing memory pool, block_size=" << block_size()
 	 << " : allocated blocks remain" << endl;
   else {
     // clear lists
-    for (int i = 0; i < thread_count; ++i) 
+    for (int i = 0; i <= thread_count; ++i) 
       local_lists[i].sz = 0;
   
     // throw away all allocated memory
     maybe<char*> x;
-    while ((x = pool_roots.pop())) pbbs::my_free(*x); //std::free(*x);
+    while ((x = pool_roots.pop())) free_blocks(*x); //std::free(*x);
     pool_roots.clear();
     global_stack.clear();
     blocks_allocated = 0;
+    blocks_out = peak_out = 0;
   }
 }
 
-block_allocator::~block_allocator() {
+inline block_allocator::~block_allocator() {
   clear();
   delete[] local_lists;
 }
 
-void block_allocator::free(void* ptr) {
-  block_p new_node = (block_p) ptr;
+inline void block_allocator::free(void* ptr) {
   int id = worker_id();
+  if (id >= 0 && id < thread_count) free_local(local_lists[id], ptr);
+  else {
+    std::lock_guard<std::mutex> lock(external_lock());
+    free_local(local_lists[thread_count], ptr);
+  }
+}
 
-  if (local_lists[id].sz == list_length+1) {
-    local_lists[id].mid = local_lists[id].head;
-  } else if (local_lists[id].sz == 2*list_length) {
-    global_stack.push(local_lists[id].mid->next);
-    local_lists[id].mid->next = NULL;
-    local_lists[id].sz = list_length;
+inline void block_allocator::free_local(thread_list &l, void* ptr) {
+  block_p new_node = (block_p) ptr;
+
+  if (l.sz == list_length+1) {
+    l.mid = l.head;
+  } else if (l.sz == 2*list_length) {
+    pbbs::fetch_and_add(&blocks_out, -list_length);
+    global_stack.push(l.mid->next);
+    l.mid->next = NULL;
+    l.sz = list_length;
   }
-  new_node->next = local_lists[id].head;
-  local_lists[id].head = new_node;
-  local_lists[id].sz++;
+  new_node->next = l.head;
+  l.head = new_node;
+  l.sz++;
 }
 
 inline void* block_allocator::alloc() {
   int id = worker_id();
+  if (id >= 0 && id < thread_count) return alloc_local(local_lists[id]);
+  std::lock_guard<std::mutex> lock(external_lock());
+  return alloc_local(local_lists[thread_count]);
+}
 
-  if (local_lists[id].sz == 0)  {
-    local_lists[id].head = get_list();
-    local_lists[id].sz = list_length;
+inline void* block_allocator::alloc_local(thread_list &l) {
+  if (l.sz == 0)  {
+    l.head = get_list();
+    l.sz = list_length;
   }
 
-  local_lists[id].sz--;
-  block_p p = local_lists[id].head;
-  local_lists[id].head = local_lists[id].head->next;
+  l.sz--;
+  block_p p = l.head;
+  l.head = l.head->next;
 
   return (void*) p;
 }
@@ -280,9 +280,9 @@ namespace pbbs {
 
 	// large blocks have indices in top half
 	else if (end > start) {
-	  auto x = [&] (size_t i) -> val_type {return get_value(B[i]);};
-	  auto vals = delayed_seq<val_type>(n, x);
-	  sums[get_key(B[i])] = reduce(vals, monoid);
+	  auto x = [&] (size_t j) -> val_type {return get_value(B[start+j]);};
+	  auto vals = delayed_seq<val_type>(end - start, x);
+	  sums[get_key(B[start])] = reduce(vals, monoid);
 	}
       }, 1);
     return sums;
@@ -20,116 +20,188 @@
 // OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
 // WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
-// Lock free, linearizable implementation of a concurrent stack
-// supporting:
+// Lock free implementation of a concurrent stack supporting:
 //    push
 //    pop
 //    size
 // Works for elements of any type T
+// Elements are held in nodes referred to by 32 bit index, so the top
+// of a stack and a counter against ABA fit in one 64 bit word, and
+// only an ordinary compare-and-swap is needed.
+// There is one stack per last level cache (up to max_shards), which
+// is per numa node or finer.  Push goes on the stack of the cache the
+// caller was on when it first used one, and pop tries that one first,
+// so elements tend to be reused near where they were freed, and
+// threads on different caches do not contend (a machine with a single
+// last level cache has a single stack).  Each of these is
+// linearizable, but a pop can miss an element being pushed on another
+// stack.
 // It requires memory proportional to the largest it has been
 // This can be cleared, but only when noone else is using it.
-// Requires 128-bit-compare-and-swap
-// Counter could overflow "in theory", but would require over 500 years even
-// if updated every nanosecond (and must be updated sequentially)
+// The counter wraps after 2^32 updates of one node's stack, and ABA
+// would need exactly that many to happen during a single pop.
 
 #pragma once
 #include <cstdio>
 #include <cstdint>
+#include <cstdlib>
 #include <iostream>
 #include "utilities.h"
+#include "topology.h"
 
 template<typename T>
 class concurrent_stack {
 
   struct Node {
     T value;
-    Node* next;
-    size_t length;
+    uint32_t next;  // index, 0 for none
+    size_t length;  // of the stack from here down
   };
 
-  class alignas(64) prim_concurrent_stack {
-    struct nodeAndCounter {
-      Node* node;
-      uint64_t counter;
-    };
-
-    union CAS_t {
-      __uint128_t x;
-      nodeAndCounter NC;
-    };
-    CAS_t head;
-
-    size_t length(Node* n) {
-      if (n == NULL) return 0;
-      else return n->length;
-    }
+  // Nodes are in chunks of 64, 128, 256, ... so that an index can
+  // address up to 2^32 of them, and are never freed before clear().
+  static constexpr size_t first_chunk = 64;
+  static constexpr int max_chunks = 27;
+  Node* chunks[max_chunks];
+  uint32_t num_nodes;
+
+  Node* node(uint32_t i) {
+    size_t j = i - 1;
+    int k = 63 - __builtin_clzl(j / first_chunk + 1);
+    Node* c = __atomic_load_n(&chunks[k], __ATOMIC_ACQUIRE);
+    return c + (j - first_chunk * ((((size_t) 1) << k) - 1));
+  }
 
-  public:
-    prim_concurrent_stack() {
-      head.NC.node = NULL;
-      head.NC.counter = 0;
-      std::atomic_thread_fence(std::memory_order_seq_cst);
-    }
+  // the top's index in the low half and the counter in the high half
+  struct alignas(64) prim_stack {
+    uint64_t head;
+  };
+
+  static uint32_t top(uint64_t h) {return (uint32_t) h;}
+  static uint64_t make_head(uint32_t i, uint64_t old) {
+    return ((old >> 32) + 1) << 32 | i;
+  }
+
+  size_t length(uint32_t i) {
+    return (i == 0) ? 0 : __atomic_load_n(&node(i)->length, __ATOMIC_RELAXED);
+  }
+
+  void push(prim_stack &s, uint32_t i) {
+    Node* n = node(i);
+    uint64_t old_head = __atomic_load_n(&s.head, __ATOMIC_RELAXED);
+    do {
+      __atomic_store_n(&n->next, top(old_head), __ATOMIC_RELAXED);
+      __atomic_store_n(&n->length, length(top(old_head)) + 1, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&s.head, &old_head, make_head(i, old_head),
+					  true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+
+  // The node read here may have been popped and pushed again since
+  // the head was read, in which case the counter has moved on and the
+  // compare-and-swap fails.
+  uint32_t pop(prim_stack &s) {
+    uint64_t old_head = __atomic_load_n(&s.head, __ATOMIC_ACQUIRE);
+    uint32_t i;
+    do {
+      i = top(old_head);
+      if (i == 0) return 0;
+      uint32_t next = __atomic_load_n(&node(i)->next, __ATOMIC_RELAXED);
+      if (__atomic_compare_exchange_n(&s.head, &old_head, make_head(next, old_head),
+				      true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+	return i;
+    } while (true);
+  }
 
-    size_t size() {
-      return length(head.NC.node);}
-
-    void push(Node* newNode){
-      CAS_t oldHead, newHead;
-      do {
-	oldHead = head;
-	newNode->next = oldHead.NC.node;
-	newNode->length = length(oldHead.NC.node) + 1;
-	//std::atomic_thread_fence(std::memory_order_release);
-	std::atomic_thread_fence(std::memory_order_seq_cst);
-	newHead.NC.node = newNode;
-	newHead.NC.counter = oldHead.NC.counter + 1;
-      } while (!__sync_bool_compare_and_swap_16(&head.x,oldHead.x, newHead.x));
+  uint32_t new_node() {
+    uint32_t i = pop(free_nodes);
+    if (i != 0) return i;
+    i = __atomic_add_fetch(&num_nodes, 1, __ATOMIC_RELAXED);
+    if (i == 0) {
+      std::cout << "too many elements in concurrent_stack" << std::endl;
+      abort();
     }
-    Node* pop() {
-      Node* result;
-      CAS_t oldHead, newHead;
-      do {
-	oldHead = head;
-	result = oldHead.NC.node;
-	if (result == NULL) return result;
-	newHead.NC.node = result->next;
-	newHead.NC.counter = oldHead.NC.counter + 1;
-      } while (!__sync_bool_compare_and_swap_16(&head.x,oldHead.x, newHead.x));
-
-      return result;
+    size_t j = i - 1;
+    int k = 63 - __builtin_clzl(j / first_chunk + 1);
+    if (__atomic_load_n(&chunks[k], __ATOMIC_ACQUIRE) == nullptr) {
+      Node* c = (Node*) calloc(first_chunk << k, sizeof(Node));
+      Node* expected = nullptr;
+      if (!__atomic_compare_exchange_n(&chunks[k], &expected, c, false,
+				       __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+	free(c);
     }
-  };// __attribute__((aligned(16)));
+    return i;
+  }
+
+  static constexpr int max_shards = 8;
+  prim_stack shards[max_shards];
+  prim_stack free_nodes;
+
+  static topology& machine() {
+    static topology t;
+    return t;
+  }
+
+  static int num_shards() {
+    static int n = std::min(max_shards, std::max(1, machine().num_l3));
+    return n;
+  }
 
-  prim_concurrent_stack a;
-  prim_concurrent_stack b;
+  // looked up once per thread, so that push and pop do not ask for
+  // the cpu every time
+  static int my_shard() {
+    if (num_shards() == 1) return 0;
+    static thread_local int shard = -1;
+    if (shard < 0) {
+      int l3 = machine().l3_of(topology::current_cpu());
+      shard = (l3 < 0) ? 0 : l3 % num_shards();
+    }
+    return shard;
+  }
 
  public:
 
-  size_t size() { return a.size();}
+  size_t size() {
+    size_t r = 0;
+    for (int j = 0; j < num_shards(); j++)
+      r += length(top(__atomic_load_n(&shards[j].head, __ATOMIC_ACQUIRE)));
+    return r;
+  }
 
   void push(T v) {
-    Node* x = b.pop();
-    if (!x) x = (Node*) malloc(sizeof(Node));
-    x->value = v;
-    a.push(x);
+    uint32_t i = new_node();
+    node(i)->value = v;
+    push(shards[my_shard()], i);
   }
 
   maybe<T> pop() {
-    Node* x = a.pop();
-    if (!x) return maybe<T>();
-    T r = x->value;
-    b.push(x);
-    return maybe<T>(r);
+    int m = num_shards();
+    int first = my_shard();
+    for (int j = 0; j < m; j++) {
+      uint32_t i = pop(shards[(first + j) % m]);
+      if (i != 0) {
+	T r = node(i)->value;
+	push(free_nodes, i);
+	return maybe<T>(r);
+      }
+    }
+    return maybe<T>();
   }
 
   // assumes no push or pop in progress
   void clear() {
-    Node* x;
-    while ((x = a.pop())) free(x);
-    while ((x = b.pop())) free(x);
+    for (int k = 0; k < max_chunks; k++) {
+      free(chunks[k]);
+      chunks[k] = nullptr;
+    }
+    for (auto &s : shards) s.head = 0;
+    free_nodes.head = 0;
+    num_nodes = 0;
   }
 
-  concurrent_stack() {}
+  concurrent_stack() : num_nodes(0) {
+    for (auto &c : chunks) c = nullptr;
+    for (auto &s : shards) s.head = 0;
+    free_nodes.head = 0;
+  }
   ~concurrent_stack() { clear();}
 };
@@ -0,0 +1,259 @@
+#pragma once
+
+// Coroutine tasks that run on the scheduler workers.  Requires C++20.
+//
+//   pbbs::task<long> sum(pbbs::sequence<long> const &a, size_t s, size_t e) {
+//     if (e - s < 100000) co_return pbbs::reduce(a.slice(s, e), pbbs::addm<long>());
+//     auto [l, r] = co_await pbbs::par(sum(a, s, (s+e)/2), sum(a, (s+e)/2, e));
+//     co_return l + r;
+//   }
+//   long total = pbbs::sync_wait(sum(a, 0, a.size()));
+//
+// A task<T> is a coroutine returning T that starts when it is awaited.
+// co_await par(a, b) runs tasks a and b in parallel and returns a pair
+// of their results, with std::monostate standing in for void.  The
+// awaiting coroutine is suspended rather than blocking its thread, and
+// is resumed by whichever worker finishes last.  Tasks can also await
+// futures (future.h) and call any of the (blocking) parallel functions
+// of the library.  Exceptions propagate to whoever awaits the task.
+// start(t) runs a task asynchronously returning a future, and
+// sync_wait(t) waits for it from ordinary code.
+// par_do and parallel_for are unaffected by any of this.
+
+#if __cplusplus < 202002L
+#error "coroutine.h requires C++20 (-std=c++20)"
+#endif
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include "parallel.h"
+#include "future.h"
+
+namespace pbbs {
+
+  template <typename T> class task;
+
+  namespace internal {
+
+    // Counts down the two halves of a par, the last resumes the parent.
+    struct join_counter {
+      std::atomic<int> count{2};
+      std::coroutine_handle<> parent;
+    };
+
+    struct task_promise_base {
+      std::coroutine_handle<> continuation;
+      join_counter* join = nullptr;
+      std::exception_ptr exception;
+
+      std::suspend_always initial_suspend() noexcept { return {}; }
+
+      struct final_awaiter {
+	bool await_ready() noexcept { return false; }
+	template <typename P>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+	  task_promise_base &p = h.promise();
+	  if (p.join != nullptr) {
+	    join_counter* j = p.join;
+	    if (j->count.fetch_sub(1) == 1) return j->parent;
+	    return std::noop_coroutine();
+	  }
+	  if (p.continuation) return p.continuation;
+	  return std::noop_coroutine();
+	}
+	void await_resume() noexcept {}
+      };
+      final_awaiter final_suspend() noexcept { return {}; }
+
+      void unhandled_exception() { exception = std::current_exception(); }
+    };
+
+    template <typename T>
+    struct task_promise : task_promise_base {
+      std::optional<T> value;
+      task<T> get_return_object();
+      template <typename U>
+      void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+      T result() {
+	if (exception) std::rethrow_exception(exception);
+	return std::move(*value);
+      }
+    };
+
+    template <>
+    struct task_promise<void> : task_promise_base {
+      task<void> get_return_object();
+      void return_void() {}
+      void result() {
+	if (exception) std::rethrow_exception(exception);
+      }
+    };
+
+    template <typename T>
+    using par_result = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+    template <typename T>
+    par_result<T> take_result(task_promise<T> &p) {
+      if constexpr (std::is_void_v<T>) {p.result(); return {};}
+      else return p.result();
+    }
+  }
+
+  template <typename T = void>
+  class task {
+  public:
+    using promise_type = internal::task_promise<T>;
+    using handle = std::coroutine_handle<promise_type>;
+
+    task(task&& other) noexcept : h(std::exchange(other.h, {})) {}
+    task& operator=(task&& other) noexcept {
+      if (this != &other) {
+	if (h) h.destroy();
+	h = std::exchange(other.h, {});
+      }
+      return *this;
+    }
+    task(task const&) = delete;
+    ~task() { if (h) h.destroy(); }
+
+    // Awaiting a task runs it, and then continues with the awaiter
+    // (on whichever worker it finished on).
+    auto operator co_await() && noexcept {
+      struct awaiter {
+	handle h;
+	bool await_ready() noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> parent) noexcept {
+	  h.promise().continuation = parent;
+	  return h;
+	}
+	T await_resume() { return h.promise().result(); }
+      };
+      return awaiter{h};
+    }
+
+    handle get_handle() const { return h; }
+
+  private:
+    friend promise_type;
+    explicit task(handle h) : h(h) {}
+    handle h;
+  };
+
+  template <typename T>
+  task<T> internal::task_promise<T>::get_return_object() {
+    return task<T>(task<T>::handle::from_promise(*this));
+  }
+
+  inline task<void> internal::task_promise<void>::get_return_object() {
+    return task<void>(task<void>::handle::from_promise(*this));
+  }
+
+  // co_await par(a, b) runs the tasks a and b in parallel.  b is made
+  // available to be stolen while this worker runs a, as with par_do.
+  template <typename A, typename B>
+  auto par(task<A> a, task<B> b) {
+    struct awaiter {
+      task<A> a;
+      task<B> b;
+      internal::join_counter join;
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> parent) {
+	join.parent = parent;
+	a.get_handle().promise().join = &join;
+	b.get_handle().promise().join = &join;
+	auto hb = b.get_handle();
+	spawn_detached([hb] () {hb.resume();});
+	return a.get_handle();
+      }
+      std::pair<internal::par_result<A>, internal::par_result<B>> await_resume() {
+	auto ra = internal::take_result(a.get_handle().promise());
+	auto rb = internal::take_result(b.get_handle().promise());
+	return {std::move(ra), std::move(rb)};
+      }
+    };
+    return awaiter{std::move(a), std::move(b), {}};
+  }
+
+  // co_await schedule() moves the rest of the coroutine to a job on the
+  // deque, where it can be stolen by another worker.
+  inline auto schedule() {
+    struct awaiter {
+      bool await_ready() noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) {
+	spawn_detached([h] () {h.resume();});
+      }
+      void await_resume() noexcept {}
+    };
+    return awaiter{};
+  }
+
+  // Awaiting a future suspends until it is ready, then continues on a
+  // scheduler job, and returns a copy of the result.
+  template <typename T>
+  auto operator co_await(future<T> f) {
+    struct awaiter {
+      future<T> f;
+      bool await_ready() { return f.ready(); }
+      void await_suspend(std::coroutine_handle<> h) {
+	f.state()->on_ready([h] () {spawn_detached([h] () {h.resume();});});
+      }
+      T await_resume() { return f.get(); }
+    };
+    return awaiter{std::move(f)};
+  }
+
+  namespace internal {
+    // a coroutine that nobody waits for, and that frees itself when done
+    struct detached_coroutine {
+      struct promise_type {
+	detached_coroutine get_return_object() { return {}; }
+	std::suspend_never initial_suspend() noexcept { return {}; }
+	std::suspend_never final_suspend() noexcept { return {}; }
+	void return_void() {}
+	void unhandled_exception() { std::terminate(); }
+      };
+    };
+
+    template <typename T>
+    detached_coroutine drive(task<T> t, std::shared_ptr<future_state<T>> s) {
+      co_await schedule();
+      std::exception_ptr e;
+      if constexpr (std::is_void_v<T>) {
+	try { co_await std::move(t); }
+	catch (...) { e = std::current_exception(); }
+	auto f = [&] () { if (e) std::rethrow_exception(e); };
+	s->run(f);
+      } else {
+	std::optional<T> v;
+	try { v.emplace(co_await std::move(t)); }
+	catch (...) { e = std::current_exception(); }
+	auto f = [&] () -> T {
+	  if (e) std::rethrow_exception(e);
+	  return std::move(*v);};
+	s->run(f);
+      }
+    }
+  }
+
+  // Runs the task asynchronously, returning a future for its result.
+  template <typename T>
+  future<T> start(task<T> t) {
+    auto s = std::make_shared<future_state<T>>();
+    internal::drive(std::move(t), s);
+    return future<T>(s);
+  }
+
+  // Runs the task and waits for its result, helping with other work
+  // while it waits.
+  template <typename T>
+  T sync_wait(task<T> t) {
+    future<T> f = start(std::move(t));
+    if constexpr (std::is_void_v<T>) f.get();
+    else return f.get();
+  }
+}
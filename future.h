@@ -0,0 +1,202 @@
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "parallel.h"
+
+// Futures and task graphs for computations that are not nested
+// fork-join, e.g. reading the next file while processing the current one.
+//
+//   auto a = pbbs::spawn([&] () {return read(f1);});
+//   auto b = pbbs::spawn([&] () {return read(f2);});
+//   auto c = pbbs::continue_when_all([=] () {
+//       return merge(a.get(), b.get());}, a, b);
+//   ... c.get() ...
+//
+// spawn(f) runs f on the scheduler workers and returns a future for its
+// result.  continue_when_all(f, deps...) runs f once all the futures it
+// depends on are ready, without any thread blocking in the meantime.
+// get() waits for the result, running other jobs while waiting, and
+// rethrows if the function threw.  Futures can be copied, and the copies
+// share the result, as with std::shared_future.
+// Only the HOMEGROWN scheduler runs them asynchronously; under the
+// others spawn(f) runs f immediately.
+// Every spawned function should eventually be waited for (directly or
+// through a continuation), since jobs still pending when the program
+// exits are never run.
+
+namespace pbbs {
+
+  // The state shared by the copies of a future.
+  struct future_base {
+    future_base() : done(false) {}
+
+    bool ready() const { return done.load(std::memory_order_acquire); }
+
+    void wait() const {
+      if (!ready()) wait_until([&] () {return ready();});
+    }
+
+    // Calls f once the future is ready, immediately if it already is.
+    void on_ready(std::function<void()> f) {
+      {
+	std::lock_guard<std::mutex> l(lock);
+	if (!ready()) {continuations.push_back(std::move(f)); return;}
+      }
+      f();
+    }
+
+  protected:
+    std::exception_ptr exception;
+
+    void set_ready() {
+      std::vector<std::function<void()>> cs;
+      {
+	std::lock_guard<std::mutex> l(lock);
+	done.store(true, std::memory_order_release);
+	cs.swap(continuations);
+      }
+      for (auto &c : cs) c();
+    }
+
+    void check() const {
+      wait();
+      if (exception) std::rethrow_exception(exception);
+    }
+
+  private:
+    std::atomic<bool> done;
+    std::mutex lock;
+    std::vector<std::function<void()>> continuations;
+  };
+
+  template <typename T>
+  struct future_state : future_base {
+    future_state() : has_value(false) {}
+    ~future_state() { if (has_value) reinterpret_cast<T*>(&value)->~T(); }
+
+    template <typename F>
+    void run(F& f) {
+      try { new (&value) T(f()); has_value = true; }
+      catch (...) { exception = std::current_exception(); }
+      set_ready();
+    }
+
+    T const& get() const {
+      check();
+      return *reinterpret_cast<T const*>(&value);
+    }
+
+  private:
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+    bool has_value;
+  };
+
+  template <>
+  struct future_state<void> : future_base {
+    template <typename F>
+    void run(F& f) {
+      try { f(); }
+      catch (...) { exception = std::current_exception(); }
+      set_ready();
+    }
+
+    void get() const { check(); }
+  };
+
+  template <typename T>
+  class future {
+  public:
+    using value_type = T;
+
+    future() {}
+    explicit future(std::shared_ptr<future_state<T>> s) : s(std::move(s)) {}
+
+    // whether this refers to a computation (is not default constructed)
+    bool valid() const { return (bool) s; }
+    bool ready() const { return s->ready(); }
+    void wait() const { s->wait(); }
+
+    // The result (a const reference, or void), rethrowing if the
+    // computation threw.  Waits if not ready.
+    auto get() const -> decltype(std::declval<future_state<T>>().get()) {
+      return s->get();
+    }
+
+    future_base* state() const { return s.get(); }
+
+  private:
+    std::shared_ptr<future_state<T>> s;
+  };
+
+  template <typename F>
+  using future_of = future<typename std::decay<decltype(std::declval<F&>()())>::type>;
+
+  // Runs f() asynchronously, returning a future for its result.
+  template <typename F>
+  future_of<F> spawn(F f) {
+    using T = typename future_of<F>::value_type;
+    auto s = std::make_shared<future_state<T>>();
+    spawn_detached([s, f = std::move(f)] () mutable { s->run(f); });
+    return future_of<F>(s);
+  }
+
+  namespace internal {
+    // Spawns f, with its result going to s, once count reaches zero.
+    template <typename T, typename F>
+    struct continuation {
+      std::shared_ptr<future_state<T>> s;
+      F f;
+      std::shared_ptr<std::atomic<size_t>> count;
+
+      void operator()() {
+	if (count->fetch_sub(1) != 1) return;
+	auto s_ = s; auto f_ = f;
+	spawn_detached([s_, f_] () mutable { s_->run(f_); });
+      }
+    };
+
+    template <typename T, typename F>
+    continuation<T,F> make_continuation(F f, size_t n) {
+      return continuation<T,F>{std::make_shared<future_state<T>>(), std::move(f),
+	  std::make_shared<std::atomic<size_t>>(n + 1)};
+    }
+  }
+
+  // Runs f() once all the futures in deps (a vector, or several
+  // arguments) are ready, returning a future for its result.
+  // f takes no arguments: it can capture the futures and call get() on
+  // them, which does not wait.  If a dependency threw, f still runs, and
+  // its get() rethrows.
+  template <typename F, typename T>
+  future_of<F> continue_when_all(F f, std::vector<future<T>> const &deps) {
+    using R = typename future_of<F>::value_type;
+    auto c = internal::make_continuation<R>(std::move(f), deps.size());
+    for (auto &d : deps) d.state()->on_ready(c);
+    c(); // the extra count, so f is not spawned before all are registered
+    return future_of<F>(c.s);
+  }
+
+  template <typename F, typename... Ts>
+  future_of<F> continue_when_all(F f, future<Ts> const &... deps) {
+    std::vector<future_base*> states = {deps.state()...};
+    using R = typename future_of<F>::value_type;
+    auto c = internal::make_continuation<R>(std::move(f), states.size());
+    for (auto d : states) d->on_ready(c);
+    c();
+    return future_of<F>(c.s);
+  }
+
+  // Waits for all the futures (but does not check for exceptions).
+  template <typename T>
+  void wait_all(std::vector<future<T>> const &fs) {
+    for (auto &f : fs) f.wait();
+  }
+}
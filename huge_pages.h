@@ -0,0 +1,139 @@
+#pragma once
+
+// Memory backed by huge pages, to cut TLB misses and page faults on
+// large inputs.  Used by the pool allocator (alloc.h) for its large
+// blocks and for the lists of small blocks, when the environment
+// variable PBBS_HUGE_PAGES is set to one of:
+//   thp  transparent huge pages: 2MB aligned memory marked with
+//        madvise(MADV_HUGEPAGE), which works whenever transparent
+//        huge pages are not disabled outright
+//   2mb  explicit 2MB pages (MAP_HUGETLB), which have to be reserved
+//        in advance, e.g. with /proc/sys/vm/nr_hugepages
+//   1gb  as 2mb, but allocations of at least 1GB use 1GB pages
+// Explicit pages fall back to smaller ones, and then to transparent
+// huge pages, when not available.  Unset or "off" means ordinary pages.
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <new>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace pbbs {
+
+  enum class huge_page_policy {off, transparent, explicit_2mb, explicit_1gb};
+
+  inline huge_page_policy huge_pages() {
+    static huge_page_policy policy = [] () {
+#if defined(__linux__)
+      const char* env = std::getenv("PBBS_HUGE_PAGES");
+      if (env == nullptr) return huge_page_policy::off;
+      if (std::strcmp(env, "thp") == 0) return huge_page_policy::transparent;
+      if (std::strcmp(env, "2mb") == 0) return huge_page_policy::explicit_2mb;
+      if (std::strcmp(env, "1gb") == 0) return huge_page_policy::explicit_1gb;
+#endif
+      return huge_page_policy::off;
+    }();
+    return policy;
+  }
+
+  constexpr size_t huge_page_2mb = ((size_t) 1) << 21;
+  constexpr size_t huge_page_1gb = ((size_t) 1) << 30;
+
+  // The page size used for an allocation of n bytes, 0 if off.
+  inline size_t huge_page_size(size_t n = 0) {
+    switch (huge_pages()) {
+    case huge_page_policy::off: return 0;
+    case huge_page_policy::explicit_1gb:
+      return (n >= huge_page_1gb) ? huge_page_1gb : huge_page_2mb;
+    default: return huge_page_2mb;
+    }
+  }
+
+#if defined(__linux__)
+
+  namespace internal {
+    inline size_t round_up(size_t n, size_t page) {
+      return (n + page - 1) / page * page;
+    }
+
+    inline void* map_explicit(size_t len, size_t page) {
+#if defined(MAP_HUGETLB)
+      int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#if defined(MAP_HUGE_SHIFT)
+      flags |= ((page == huge_page_1gb) ? 30 : 21) << MAP_HUGE_SHIFT;
+#endif
+      void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+      return (p == MAP_FAILED) ? nullptr : p;
+#else
+      (void) len; (void) page;
+      return nullptr;
+#endif
+    }
+
+    // 2MB aligned so the kernel can back it with huge pages
+    inline void* map_transparent(size_t len) {
+      size_t extra = len + huge_page_2mb;
+      char* p = (char*) mmap(nullptr, extra, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) return nullptr;
+      char* start = (char*) round_up((uintptr_t) p, huge_page_2mb);
+      if (start > p) munmap(p, start - p);
+      if (p + extra > start + len) munmap(start + len, p + extra - (start + len));
+#if defined(MADV_HUGEPAGE)
+      madvise(start, len, MADV_HUGEPAGE);
+#endif
+      return start;
+    }
+  }
+
+  // Allocates n bytes on huge pages, following huge_pages(), which
+  // should not be off.  The size mapped only depends on n, so that
+  // huge_free(p, n) unmaps exactly what was mapped whichever page
+  // size the allocation ended up with.
+  inline void* huge_alloc(size_t n) {
+    size_t page = huge_page_size(n);
+    size_t len = internal::round_up(n, page);
+    void* p = nullptr;
+    if (huge_pages() == huge_page_policy::explicit_1gb && page == huge_page_1gb)
+      p = internal::map_explicit(len, huge_page_1gb);
+    if (p == nullptr && huge_pages() != huge_page_policy::transparent)
+      p = internal::map_explicit(len, huge_page_2mb);
+    if (p == nullptr) p = internal::map_transparent(len);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+  }
+
+  inline void huge_free(void* p, size_t n) {
+    munmap(p, internal::round_up(n, huge_page_size(n)));
+  }
+
+  // n bytes on ordinary pages straight from the system, so that
+  // unmap_pages gives them back (unlike free, see alloc.h)
+  inline void* map_pages(size_t n) {
+    void* p = mmap(nullptr, n, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw std::bad_alloc();
+    return p;
+  }
+
+  inline void unmap_pages(void* p, size_t n) { munmap(p, n); }
+
+#else
+
+  inline void* huge_alloc(size_t n) {
+    void* p = std::malloc(n);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+  }
+
+  inline void huge_free(void* p, size_t) { std::free(p); }
+
+  inline void* map_pages(size_t n) { return huge_alloc(n); }
+
+  inline void unmap_pages(void* p, size_t) { std::free(p); }
+
+#endif
+}
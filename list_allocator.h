@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <atomic>
+#include <mutex>
 #include "concurrent_stack.h"
 #include "utilities.h"
 #include "random_shuffle.h"
@@ -84,7 +85,8 @@ class list_allocator {
  private:
   static concurrent_stack<block_p> pool_roots;
   static concurrent_stack<block_p> global_stack;
-  static thread_list* local_lists;
+  static thread_list* local_lists; // one per worker, then one for other threads
+  static std::mutex external_lock;
 
   static int thread_count;
   static size_t list_length;
@@ -92,6 +94,8 @@ class list_allocator {
   static size_t _block_size;
   static std::atomic<size_t> blocks_allocated;
   static block_p allocate_blocks(size_t num_blocks);
+  static T* alloc_local(thread_list &l);
+  static void free_local(thread_list &l, T* node);
 };
 
 template<typename T> concurrent_stack<typename list_allocator<T>::block_p>
@@ -106,6 +110,9 @@ list_allocator<T>::initialized = false;
 template<typename T> typename list_allocator<T>::thread_list*
 list_allocator<T>::local_lists;
 
+template<typename T> std::mutex
+list_allocator<T>::external_lock;
+
 template<typename T> int
 list_allocator<T>::thread_count;
 
@@ -138,7 +145,7 @@ auto list_allocator<T>::initialize_list(block_p start) -> block_p {
 template<typename T>
 size_t list_allocator<T>::num_used_blocks() {
   size_t free_blocks = global_stack.size()*list_length;
-  for (int i = 0; i < thread_count; ++i)
+  for (int i = 0; i <= thread_count; ++i)
     free_blocks += local_lists[i].sz;
   return blocks_allocated - free_blocks;
 }
@@ -241,7 +248,7 @@ void list_allocator<T>::init(size_t _alloc_size, size_t _list_size) {
     reserve(_alloc_size);
 
     // all local lists start out empty
-    local_lists = new thread_list[thread_count];
+    local_lists = new thread_list[thread_count+1];
 }
 
 template<typename T>
@@ -259,35 +266,52 @@ void list_allocator<T>::finish() {
     initialized = false;
 }
 
+// Threads that are not workers, or beyond the workers there were at
+// init(), share the last local list, under a lock.
 template<typename T>
 void list_allocator<T>::free(T* node) {
-    block_p new_node = (block_p) node;
     int id = worker_id();
+    if (id >= 0 && id < thread_count) free_local(local_lists[id], node);
+    else {
+      std::lock_guard<std::mutex> lock(external_lock);
+      free_local(local_lists[thread_count], node);
+    }
+}
 
-    if (local_lists[id].sz == list_length+1) {
-      local_lists[id].mid = local_lists[id].head;
-    } else if (local_lists[id].sz == 2*list_length) {
-        global_stack.push(local_lists[id].mid->next);
-        local_lists[id].mid->next = NULL;
-        local_lists[id].sz = list_length;
+template<typename T>
+inline void list_allocator<T>::free_local(thread_list &l, T* node) {
+    block_p new_node = (block_p) node;
+
+    if (l.sz == list_length+1) {
+      l.mid = l.head;
+    } else if (l.sz == 2*list_length) {
+        global_stack.push(l.mid->next);
+        l.mid->next = NULL;
+        l.sz = list_length;
     }
-    new_node->next = local_lists[id].head;
-    local_lists[id].head = new_node;
-    local_lists[id].sz++;
+    new_node->next = l.head;
+    l.head = new_node;
+    l.sz++;
 }
 
 template<typename T>
 inline T* list_allocator<T>::alloc() {
     int id = worker_id();
+    if (id >= 0 && id < thread_count) return alloc_local(local_lists[id]);
+    std::lock_guard<std::mutex> lock(external_lock);
+    return alloc_local(local_lists[thread_count]);
+}
 
-    if (!local_lists[id].sz)  {
-      local_lists[id].head = get_list();
-      local_lists[id].sz = list_length;
+template<typename T>
+inline T* list_allocator<T>::alloc_local(thread_list &l) {
+    if (!l.sz)  {
+      l.head = get_list();
+      l.sz = list_length;
     }
 
-    local_lists[id].sz--;
-    block_p p = local_lists[id].head;
-    local_lists[id].head = local_lists[id].head->next;
+    l.sz--;
+    block_p p = l.head;
+    l.head = l.head->next;
 
     return &p->data;
 }
@@ -0,0 +1,173 @@
+#pragma once
+
+// Placement of memory on numa nodes.  By default pages go on the node
+// of the thread that first touches them, which for a sequence built
+// with a parallel_for is wherever the workers happened to run.
+// A placement can instead be given for an allocation:
+//   memory_placement::interleave()  pages round robin across all nodes,
+//      so bandwidth bound loops use the memory of every socket
+//   memory_placement::node(k)  all pages on node k
+//   memory_placement::local()  all pages on the node of the calling thread
+//   memory_placement::first_touch()  the default
+// e.g.
+//   pbbs::sequence<long> a(n, f, pbbs::memory_placement::interleave());
+// The environment variable PBBS_NUMA ("interleave", "local", or a node
+// number) sets a placement for all large blocks the pool allocator
+// gets from the system.
+// Only whole pages are placed, and pages already touched are moved.
+// The placement is dropped when the memory is freed through the pool
+// allocator or my_free (see unplace_memory), so that blocks they reuse
+// do not keep it.
+// Uses mbind (Linux only, without needing libnuma); elsewhere, or if
+// it fails, placement is ignored.
+
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "topology.h"
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+namespace pbbs {
+
+  struct memory_placement {
+    enum kind_t {by_first_touch, by_local, by_interleave, by_node};
+    kind_t kind;
+    int node_id; // for by_node, as numbered by the OS (e.g. numactl -H)
+
+    static memory_placement first_touch() { return {by_first_touch, -1}; }
+    static memory_placement local() { return {by_local, -1}; }
+    static memory_placement interleave() { return {by_interleave, -1}; }
+    static memory_placement node(int k) { return {by_node, k}; }
+
+    // the placement given by PBBS_NUMA
+    static memory_placement from_environment() {
+      static memory_placement p = [] () {
+	const char* env = std::getenv("PBBS_NUMA");
+	if (env == nullptr) return first_touch();
+	std::string s(env);
+	if (s == "interleave") return interleave();
+	if (s == "local") return local();
+	if (!s.empty() && isdigit(s[0])) return node(std::stoi(s));
+	return first_touch();
+      }();
+      return p;
+    }
+  };
+
+#if defined(__linux__)
+
+  namespace internal {
+    // as in linux/mempolicy.h
+    constexpr int mpol_default = 0;
+    constexpr int mpol_bind = 2;
+    constexpr int mpol_interleave = 3;
+    constexpr unsigned mpol_mf_move = 1 << 1;
+    constexpr size_t max_numa_nodes = 1024;
+
+    using node_mask = std::vector<unsigned long>;
+
+    inline void add_node(node_mask &mask, int k) {
+      size_t bits = 8 * sizeof(unsigned long);
+      if (k >= 0 && (size_t) k < max_numa_nodes) mask[k / bits] |= 1ul << (k % bits);
+    }
+
+    inline node_mask online_nodes() {
+      static node_mask online = [] () {
+	node_mask mask(max_numa_nodes / (8 * sizeof(unsigned long)), 0);
+	std::ifstream in("/sys/devices/system/node/online");
+	std::string line;
+	if (std::getline(in, line))
+	  for (int k : topology::parse_cpu_list(line)) add_node(mask, k);
+	else add_node(mask, 0);
+	return mask;
+      }();
+      return online;
+    }
+
+    // The pages placed, keyed by the pointer given to place_memory.
+    struct placed_ranges {
+      std::mutex lock;
+      std::map<uintptr_t, std::pair<uintptr_t, uintptr_t>> ranges;
+      std::atomic<size_t> count{0};
+    };
+
+    inline placed_ranges& placed() {
+      static placed_ranges r;
+      return r;
+    }
+
+    inline int current_node() {
+      unsigned cpu, node;
+      if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) return 0;
+      return (int) node;
+    }
+  }
+
+  // Places the whole pages of [p, p + bytes), returning whether it did.
+  // Unless recorded is false (for memory that keeps the placement for
+  // as long as it is mapped), unplace_memory drops it when freed.
+  inline bool place_memory(void* p, size_t bytes, memory_placement m,
+			   bool recorded = true) {
+    using namespace internal;
+    if (m.kind == memory_placement::by_first_touch) return false;
+    static size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) p + page - 1) / page * page;
+    uintptr_t end = ((uintptr_t) p + bytes) / page * page;
+    if (end <= start) return false;
+    node_mask mask(max_numa_nodes / (8 * sizeof(unsigned long)), 0);
+    int mode = mpol_bind;
+    if (m.kind == memory_placement::by_interleave) {
+      mask = online_nodes();
+      mode = mpol_interleave;
+    } else add_node(mask, (m.kind == memory_placement::by_node) ? m.node_id
+		    : current_node());
+    if (syscall(SYS_mbind, start, end - start, mode, mask.data(),
+		max_numa_nodes + 1, mpol_mf_move) != 0)
+      return false;
+    if (!recorded) return true;
+    placed_ranges &r = placed();
+    std::lock_guard<std::mutex> lock(r.lock);
+    if (r.ranges.emplace((uintptr_t) p, std::make_pair(start, end)).second)
+      r.count++;
+    return true;
+  }
+
+  // Called as [p, p + bytes) is freed, to give the pages placed in it
+  // back the default policy.  If bytes is 0, only a placement made at
+  // p exactly (for frees that do not know the size).  Costs an atomic
+  // load when nothing is placed.
+  inline void unplace_memory(void* p, size_t bytes) {
+    using namespace internal;
+    placed_ranges &r = placed();
+    if (r.count.load(std::memory_order_relaxed) == 0) return;
+    std::lock_guard<std::mutex> lock(r.lock);
+    auto it = r.ranges.lower_bound((uintptr_t) p);
+    while (it != r.ranges.end() &&
+	   (it->first == (uintptr_t) p || it->first < (uintptr_t) p + bytes)) {
+      uintptr_t start = it->second.first, end = it->second.second;
+      syscall(SYS_mbind, start, end - start, mpol_default, nullptr, 0, 0);
+      it = r.ranges.erase(it);
+      r.count--;
+      if (bytes == 0) break;
+    }
+  }
+
+#else
+
+  inline bool place_memory(void*, size_t, memory_placement, bool = true) {
+    return false;
+  }
+
+  inline void unplace_memory(void*, size_t) {}
+
+#endif
+}
@@ -9,7 +9,11 @@
 //template <>
 static int num_workers();
 
+// the most workers there can be, which set_num_workers cannot exceed
+static int max_workers();
+
 // id of running thread, should be numbered from [0...num-workers)
+// (-1 for threads outside the pool with the HOMEGROWN scheduler)
 static int worker_id();
 
 // the granularity of a simple loop (e.g. adding one to each element
@@ -35,6 +39,74 @@ static void par_do(Lf left, Rf right, bool conservative=false);
 
 //***************************************
 
+#include <atomic>
+#include <climits>
+#include <thread>
+#include <vector>
+
+// Lets the iterations of a parallel_for stop the rest of the loop.
+// An iteration calls cancel() to skip all iterations that have not
+// started, or cancel_from(i) to skip just those at i or beyond (the
+// earlier ones still run, as needed to find the first match).
+// The loop checks the token between chunks of iterations, so a few
+// iterations can run after a cancel.  A token can be shared by
+// several loops, and stays cancelled until reset.
+struct cancellation_token {
+  cancellation_token() : limit(LONG_MAX) {}
+  void cancel() { limit.store(LONG_MIN, std::memory_order_relaxed); }
+  void cancel_from(long i) {
+    long l = limit.load(std::memory_order_relaxed);
+    while (i < l && !limit.compare_exchange_weak(l, i));
+  }
+  // has anything been cancelled
+  bool cancelled() const {
+    return limit.load(std::memory_order_relaxed) != LONG_MAX;}
+  // has iteration i been cancelled
+  bool cancelled(long i) const {
+    return i >= limit.load(std::memory_order_relaxed);}
+  void reset() { limit.store(LONG_MAX); }
+private:
+  std::atomic<long> limit;
+};
+
+// as above, but the iterations can be cancelled with tok
+template <typename F>
+static void parallel_for(long start, long end, F f,
+			 cancellation_token &tok,
+			 long granularity = 0,
+			 bool conservative = false);
+
+// Runs the thunk f asynchronously, or immediately if the scheduler
+// does not support it.  Nothing waits for f, so it should signal when
+// it is done, and should not throw.  Used to implement futures (future.h).
+template <typename F>
+static void spawn_detached(F f);
+
+// Waits until finished() is true, helping with other work meanwhile.
+template <typename F>
+static void wait_until(F finished);
+
+// Parallel loops over 2d and 3d ranges, e.g. [r_start, r_end) x
+// [c_start, c_end), that call f on tiles rather than single points:
+// f(r_start', r_end', c_start', c_end') for 2d, and similarly with six
+// arguments for 3d.  The range is recursively cut in half along its
+// longest dimension until a tile has at most granularity points
+// (PAR_GRANULARITY if 0), which makes the tiles cache oblivious.
+template <typename F>
+static void parallel_for_2d(long r_start, long r_end,
+			    long c_start, long c_end, F f,
+			    long granularity = 0,
+			    bool conservative = false);
+
+template <typename F>
+static void parallel_for_3d(long x_start, long x_end,
+			    long y_start, long y_end,
+			    long z_start, long z_end, F f,
+			    long granularity = 0,
+			    bool conservative = false);
+
+//***************************************
+
 // cilkplus
 #if defined(CILK)
 #include <cilk/cilk.h>
@@ -44,6 +116,7 @@ static void par_do(Lf left, Rf right, bool conservative=false);
 #define PAR_GRANULARITY 2000
 
 inline int num_workers() {return __cilkrts_get_nworkers();}
+inline int max_workers() {return __cilkrts_get_nworkers();}
 inline int worker_id() {return __cilkrts_get_worker_number();}
 inline void set_num_workers(int) {
   throw std::runtime_error("don't know how to set worker count!");
@@ -85,6 +158,7 @@ inline void parallel_for(long start, long end, F f,
 #define PAR_GRANULARITY 200000
 
 inline int num_workers() { return omp_get_max_threads(); }
+inline int max_workers() { return omp_get_max_threads(); }
 inline int worker_id() { return omp_get_thread_num(); }
 inline void set_num_workers(int n) { omp_set_num_threads(n); }
 
@@ -148,6 +222,10 @@ inline int num_workers() {
   return fj.num_workers();
 }
 
+inline int max_workers() {
+  return fj.max_workers();
+}
+
 inline int worker_id() {
   return fj.worker_id();
 }
@@ -164,11 +242,56 @@ inline void parallel_for(long start, long end, F f,
     fj.parfor(start, end, f, granularity, conservative);
 }
 
+template <class F>
+inline void parallel_for(long start, long end, F f,
+			 cancellation_token &tok,
+			 long granularity,
+			 bool conservative) {
+  if (end > start)
+    fj.parfor_until(start, end, f, [&] (size_t i) {return tok.cancelled(i);},
+		    granularity, conservative);
+}
+
 template <typename Lf, typename Rf>
 inline void par_do(Lf left, Rf right, bool conservative) {
   return fj.pardo(left, right, conservative);
 }
 
+template <typename F>
+inline void spawn_detached(F f) {
+  fj.spawn(f);
+}
+
+template <typename F>
+inline void wait_until(F finished) {
+  fj.wait_until(finished);
+}
+
+// A group of num_workers workers, with a priority, in which code can
+// be run isolated from other work: jobs forked within execute(f) are
+// only run by the arena's workers, the caller, and workers of arenas
+// that lend.  If lend is true the arena's workers help other arenas
+// when they have nothing to do, higher priority arenas first.
+// The workers are taken from the default arena (where everything else
+// runs) and given back when the arena is destroyed.  The default arena
+// can be configured with fj.sched->set_arena(0, priority, lend).
+class worker_arena {
+public:
+  worker_arena(int num_workers, int priority = 0, bool lend = true)
+    : id(fj.sched->create_arena(num_workers, priority, lend)) {}
+  ~worker_arena() { fj.sched->destroy_arena(id); }
+  worker_arena(worker_arena const&) = delete;
+  worker_arena& operator=(worker_arena const&) = delete;
+
+  template <typename F>
+  void execute(F f) { fj.execute(id, f); }
+
+  std::vector<int> workers() { return fj.sched->workers_of_arena(id); }
+
+private:
+  int id;
+};
+
 template <typename Job>
 inline void parallel_run(Job job, int) {
   job();
@@ -178,6 +301,7 @@ inline void parallel_run(Job job, int) {
 #else
 
 inline int num_workers() { return 1;}
+inline int max_workers() { return 1;}
 inline int worker_id() { return 0;}
 inline void set_num_workers(int) { ; }
 #define PAR_GRANULARITY 1000
@@ -202,3 +326,104 @@ inline void parallel_run(Job job, int) { // num_threads=0) {
 }
 
 #endif
+
+#if !defined(HOMEGROWN)
+template <typename F>
+inline void spawn_detached(F f) {
+  f();
+}
+
+// Without the homegrown scheduler there is only one group of workers.
+class worker_arena {
+public:
+  worker_arena(int, int = 0, bool = true) {}
+  template <typename F>
+  void execute(F f) { f(); }
+  std::vector<int> workers() { return {}; }
+};
+
+template <typename F>
+inline void wait_until(F finished) {
+  while (!finished()) std::this_thread::yield();
+}
+
+// The other schedulers have no way to stop a loop, so it is split
+// into blocks with par_do, checking the token before each block.
+template <class F>
+inline void parallel_for(long start, long end, F f,
+			 cancellation_token &tok,
+			 long granularity,
+			 bool conservative) {
+  if (granularity == 0) granularity = PAR_GRANULARITY;
+  if (tok.cancelled(start)) return;
+  if (end - start <= granularity) {
+    for (long i=start; i < end; i++) {
+      if (tok.cancelled(i)) return;
+      f(i);
+    }
+  } else {
+    long mid = start + (end - start)/2;
+    par_do([&] () {parallel_for(start, mid, f, tok, granularity, conservative);},
+	   [&] () {parallel_for(mid, end, f, tok, granularity, conservative);},
+	   conservative);
+  }
+}
+#endif
+
+// Splits the longest dimension of the box [lo, hi) until it has at
+// most granularity points, calling leaf(lo, hi) on each piece.
+template <int D, typename F>
+inline void parallel_for_box(long (&lo)[D], long (&hi)[D], F& leaf,
+			     long granularity, bool conservative) {
+  int d = 0;
+  long size = 1;
+  for (int i=0; i < D; i++) {
+    if (hi[i] <= lo[i]) return;
+    if (hi[i] - lo[i] > hi[d] - lo[d]) d = i;
+    size *= hi[i] - lo[i];
+  }
+  if (size <= granularity || hi[d] - lo[d] <= 1) {
+    leaf(lo, hi);
+    return;
+  }
+  long mid = lo[d] + (hi[d] - lo[d])/2;
+  par_do([&] () {
+      long hi2[D];
+      for (int i=0; i < D; i++) hi2[i] = hi[i];
+      hi2[d] = mid;
+      parallel_for_box<D>(lo, hi2, leaf, granularity, conservative);},
+    [&] () {
+      long lo2[D];
+      for (int i=0; i < D; i++) lo2[i] = lo[i];
+      lo2[d] = mid;
+      parallel_for_box<D>(lo2, hi, leaf, granularity, conservative);},
+    conservative);
+}
+
+template <typename F>
+inline void parallel_for_2d(long r_start, long r_end,
+			    long c_start, long c_end, F f,
+			    long granularity,
+			    bool conservative) {
+  long lo[2] = {r_start, c_start};
+  long hi[2] = {r_end, c_end};
+  auto leaf = [&] (long (&l)[2], long (&h)[2]) {f(l[0], h[0], l[1], h[1]);};
+  parallel_for_box<2>(lo, hi, leaf,
+		      granularity == 0 ? PAR_GRANULARITY : granularity,
+		      conservative);
+}
+
+template <typename F>
+inline void parallel_for_3d(long x_start, long x_end,
+			    long y_start, long y_end,
+			    long z_start, long z_end, F f,
+			    long granularity,
+			    bool conservative) {
+  long lo[3] = {x_start, y_start, z_start};
+  long hi[3] = {x_end, y_end, z_end};
+  auto leaf = [&] (long (&l)[3], long (&h)[3]) {
+    f(l[0], h[0], l[1], h[1], l[2], h[2]);};
+  parallel_for_box<3>(lo, hi, leaf,
+		      granularity == 0 ? PAR_GRANULARITY : granularity,
+		      conservative);
+}
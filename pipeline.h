@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <exception>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "parallel.h"
+#include "future.h"
+
+// A pipeline over a stream of chunks, for inputs that should not be
+// materialized all at once, e.g. reading a file a block at a time,
+// tokenizing and hashing each block, and adding the result into a table:
+//
+//   pbbs::pipeline<sequence<char>>(8,
+//     [&] (sequence<char> &block) {return read_block(in, block);},
+//     [&] (sequence<char> &&block) {return count_words(block);},
+//     [&] (sequence<word_count> const &counts) {add_to(table, counts);});
+//
+//   source(chunk) fills in the next chunk (a T&) and returns true, or
+//     returns false when there are no more.  Called serially, in order,
+//     on the calling thread.
+//   work(chunk) processes a chunk (passed as T&&) and returns a result.
+//     Runs on several chunks in parallel, and can itself be parallel.
+//   sink(result) consumes a result (passed as a const reference).
+//     Called serially and in the order of the chunks.
+//
+// At most depth chunks are in flight (read but not yet sunk), so memory
+// is proportional to depth times the size of a chunk rather than the
+// size of the input.  The three stages overlap: while the sink runs on
+// one chunk, later ones are being worked on and read.
+// If any stage throws, no more chunks are read, and the first exception
+// (in chunk order) is rethrown once the chunks in flight are done.
+// Only the HOMEGROWN scheduler overlaps the stages; under the others
+// each chunk goes through all three stages before the next is read.
+
+namespace pbbs {
+
+  template <typename T, typename Source, typename Work, typename Sink>
+  void pipeline(size_t depth, Source source, Work work, Sink sink) {
+    depth = std::max<size_t>(depth, 1);
+    // the sink of each chunk in flight, indexed by chunk mod depth
+    std::vector<future<void>> sunk(depth);
+    future<void> last;
+    auto wait_all = [&] () {for (auto &f : sunk) if (f.valid()) f.wait();};
+    try {
+      for (size_t i = 0; ; i++) {
+	future<void> &slot = sunk[i % depth];
+	if (slot.valid()) {
+	  slot.get(); // waits for room, and stops if a stage threw
+	  slot = future<void>();
+	}
+	T chunk;
+	if (!source(chunk)) break;
+	auto result = spawn([&work, c = std::move(chunk)] () mutable {
+	    return work(std::move(c));});
+	// sinks are chained so they run in order, and an exception in
+	// one chunk is passed on to all later ones
+	if (last.valid())
+	  last = continue_when_all([&sink, result, last] () {
+	      last.get();
+	      sink(result.get());}, result, last);
+	else
+	  last = continue_when_all([&sink, result] () {
+	      sink(result.get());}, result);
+	slot = last;
+      }
+    } catch (...) {
+      // the jobs in flight refer to work and sink
+      wait_all();
+      throw;
+    }
+    wait_all();
+    if (last.valid()) last.get();
+  }
+}
@@ -2,9 +2,21 @@
 
 #include <chrono>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <cstdint>
 #include <iostream>
 #include <functional>
+#include <stdexcept>
+#include <exception>
+#include <vector>
+#include <string>
+#include <climits>
+#include <cstdlib>
+#include <new>
+#include "topology.h"
 
 // EXAMPLE USE 1:
 //
@@ -33,106 +45,217 @@
 // init(a, n);
 
 
-// Deque from Arora, Blumofe, and Plaxton (SPAA, 1998).
+// Before C++17, new[] ignores alignment beyond that of max_align_t, so
+// types padded out to cache lines with alignas are allocated with these.
+template <typename T>
+T* new_aligned_array(size_t n) {
+  void* p = aligned_alloc(alignof(T), n * sizeof(T));
+  if (p == nullptr) throw std::bad_alloc();
+  T* a = static_cast<T*>(p);
+  for (size_t i = 0; i < n; i++) new (a + i) T();
+  return a;
+}
+
+template <typename T>
+void delete_aligned_array(T* a, size_t n) {
+  if (a == nullptr) return;
+  for (size_t i = 0; i < n; i++) a[i].~T();
+  free(a);
+}
+
+// Deque from Chase and Lev (SPAA, 2005), using the C11 memory orderings
+// given by Le, Pop, Cohen and Zappa Nardelli (PPoPP, 2013).
+// The owner pushes and pops at the bottom and thieves pop from the top.
+// The circular buffer doubles whenever it fills up, so there is no bound
+// on the nesting depth of fork-join code.  Thieves can still be reading
+// from an old buffer after the owner has switched to a new one, so old
+// buffers are kept on a list until the deque is destroyed.  Since the
+// sizes double, this at most doubles the space used.
 template <typename Job>
 struct Deque {
-  using qidx = unsigned int;
-  using tag_t = unsigned int;
-
-  // use unit for atomic access
-  union age_t {
-    struct {
-      tag_t tag;
-      qidx top;
-    } pair;
-    size_t unit;
-  };
+  using qidx = long;
 
-  // align to avoid false sharing
-  struct alignas(64) padded_job { Job* job;  };
+  struct circular_array {
+    size_t log_size;
+    size_t mask;
+    std::atomic<Job*>* buf;
+    circular_array* retired; // previous (smaller) buffer, if any
 
-  static int const q_size = 200;
-  age_t age;
-  qidx bot;
-  padded_job deq[q_size];
+    circular_array(size_t log_size)
+      : log_size(log_size), mask((((size_t) 1) << log_size) - 1),
+	buf(new std::atomic<Job*>[((size_t) 1) << log_size]),
+	retired(nullptr) {}
 
-  inline bool cas(size_t* ptr, size_t oldv, size_t newv) {
-    return __sync_bool_compare_and_swap(ptr, oldv, newv);
-  }
+    ~circular_array() { delete[] buf; }
 
-  inline void fence() {
-    std::atomic_thread_fence(std::memory_order_seq_cst);
+    qidx size() { return mask + 1; }
+
+    Job* get(qidx i) {
+      return buf[i & mask].load(std::memory_order_relaxed);
+    }
+
+    void put(qidx i, Job* job) {
+      buf[i & mask].store(job, std::memory_order_relaxed);
+    }
+
+    // copy [top, bot) into a buffer of twice the size
+    circular_array* grow(qidx top, qidx bot) {
+      circular_array* a = new circular_array(log_size + 1);
+      for (qidx i = top; i < bot; i++) a->put(i, get(i));
+      a->retired = this;
+      return a;
+    }
+  };
+
+  static size_t const initial_log_size = 8;
+
+  // top and bot on separate cache lines to avoid false sharing
+  // between the owner and the thieves
+  alignas(64) std::atomic<qidx> top;
+  alignas(64) std::atomic<qidx> bot;
+  std::atomic<circular_array*> array;
+
+  Deque() : top(0), bot(0) {
+    array = new circular_array(initial_log_size);
   }
 
-  Deque() : bot(0) {
-    age.pair.tag = 0;
-    age.pair.top = 0;
+  ~Deque() {
+    circular_array* a = array.load(std::memory_order_relaxed);
+    while (a != nullptr) {
+      circular_array* prev = a->retired;
+      delete a;
+      a = prev;
+    }
   }
 
+  // only called by the owner
   void push_bottom(Job* job) {
-    qidx local_bot;
-    local_bot = bot; // atomic load
-    deq[local_bot].job = job; // shared store
-    local_bot += 1;
-    if (local_bot == q_size) 
-      throw std::runtime_error("internal error: scheduler queue overflow");
-    bot = local_bot; // shared store
-    fence();
+    qidx b = bot.load(std::memory_order_relaxed);
+    qidx t = top.load(std::memory_order_acquire);
+    circular_array* a = array.load(std::memory_order_relaxed);
+    if (b - t > a->size() - 1) {
+      a = a->grow(t, b);
+      array.store(a, std::memory_order_release);
+    }
+    a->put(b, job);
+    std::atomic_thread_fence(std::memory_order_release);
+    bot.store(b + 1, std::memory_order_relaxed);
   }
 
+  // called by thieves
   Job* pop_top() {
-    age_t old_age, new_age;
-    qidx local_bot;
-    Job *job, *result;
-    old_age.unit = age.unit; // atomic load
-
-    local_bot = bot; // atomic load
-    if (local_bot <= old_age.pair.top)
-      result = NULL;
-    else {
-      job = deq[old_age.pair.top].job; // atomic load
-      new_age.unit = old_age.unit;
-      new_age.pair.top = new_age.pair.top + 1;
-      if (cas(&(age.unit), old_age.unit, new_age.unit))  // cas
-	result = job;
-      else
-	result = NULL;
-    }
-    return result;
+    return pop_top_if([] () {return true;});
   }
 
+  // Steals only if ok() holds after top is read, so that ok() can check
+  // state the owner only changes after calling invalidate_top().
+  template <typename P>
+  Job* pop_top_if(P ok) {
+    qidx t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!ok()) return NULL;
+    qidx b = bot.load(std::memory_order_acquire);
+    if (t >= b) return NULL;
+    circular_array* a = array.load(std::memory_order_acquire);
+    Job* job = a->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+				     std::memory_order_relaxed))
+      return NULL;
+    return job;
+  }
+
+  // only called by the owner
   Job* pop_bottom() {
-    age_t old_age, new_age;
-    qidx local_bot;
-    Job *job, *result;
-    local_bot = bot; // atomic load
-    if (local_bot == 0)
-      result = NULL;
-    else {
-      local_bot = local_bot - 1;
-      bot = local_bot; // shared store
-      fence();
-      job = deq[local_bot].job; // atomic load
-      old_age.unit = age.unit; // atomic load
-      if (local_bot > old_age.pair.top)
-	result = job;
-      else {
-	bot = 0; // shared store
-	new_age.pair.top = 0;
-	new_age.pair.tag = old_age.pair.tag + 1;
-	if ((local_bot == old_age.pair.top) &&
-	    cas(&(age.unit), old_age.unit, new_age.unit))
-	  result = job;
-	else {
-	  age.unit = new_age.unit; // shared store
-	  result = NULL;
-	}
-	fence();
+    qidx b = bot.load(std::memory_order_relaxed) - 1;
+    circular_array* a = array.load(std::memory_order_relaxed);
+    bot.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    qidx t = top.load(std::memory_order_relaxed);
+    Job* job = NULL;
+    if (t <= b) {
+      job = a->get(b);
+      if (t == b) { // last one, race against thieves
+	if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+					 std::memory_order_relaxed))
+	  job = NULL;
+	bot.store(b + 1, std::memory_order_relaxed);
       }
+    } else bot.store(b + 1, std::memory_order_relaxed);
+    return job;
+  }
+
+  // only called by the owner when empty: moves top and bot past an
+  // unused index, so that any steal that started earlier fails
+  void invalidate_top() {
+    qidx t = top.load(std::memory_order_relaxed);
+    top.store(t + 1, std::memory_order_seq_cst);
+    bot.store(t + 1, std::memory_order_relaxed);
+  }
+
+  // approximate, only used as a hint
+  bool empty() {
+    return bot.load(std::memory_order_relaxed) <=
+      top.load(std::memory_order_relaxed);
+  }
+
+  // approximate, only used for statistics
+  qidx size() {
+    return std::max<qidx>(0, bot.load(std::memory_order_relaxed) -
+			  top.load(std::memory_order_relaxed));
+  }
+
+};
+
+// A snapshot of the scheduler counters, see scheduler::stats().
+struct scheduler_stats {
+  struct worker {
+    size_t jobs_spawned = 0;
+    size_t jobs_run = 0;     // run from the scheduler loop, i.e. not inline
+    size_t steals[3] = {0, 0, 0}; // successful, by level: l3, node, machine
+    size_t failed_steals = 0;
+    size_t max_depth = 0;    // most jobs seen on the worker's deque
+    double idle_time = 0.0;  // seconds looking for work, including sleeping
+    double sleep_time = 0.0; // seconds parked with nothing to do
+
+    size_t total_steals() const { return steals[0] + steals[1] + steals[2]; }
+
+    void add(worker const &w) {
+      jobs_spawned += w.jobs_spawned;
+      jobs_run += w.jobs_run;
+      for (int l=0; l < 3; l++) steals[l] += w.steals[l];
+      failed_steals += w.failed_steals;
+      max_depth = std::max(max_depth, w.max_depth);
+      idle_time += w.idle_time;
+      sleep_time += w.sleep_time;
     }
-  return result;
+  };
+
+  std::vector<worker> workers;
+  double elapsed = 0.0; // seconds since the counters were last reset
+
+  worker total() const {
+    worker r;
+    for (auto &w : workers) r.add(w);
+    return r;
   }
 
+  void print(std::ostream &os = std::cout) const {
+    auto line = [&] (std::string const &name, worker const &w) {
+      os << name << ": spawned=" << w.jobs_spawned
+	 << ", run=" << w.jobs_run
+	 << ", steals=" << w.total_steals()
+	 << " (l3=" << w.steals[0] << ", node=" << w.steals[1]
+	 << ", machine=" << w.steals[2] << ")"
+	 << ", failed=" << w.failed_steals
+	 << ", max depth=" << w.max_depth
+	 << ", idle=" << w.idle_time << "s"
+	 << ", sleep=" << w.sleep_time << "s" << std::endl;
+    };
+    os << "scheduler stats over " << elapsed << "s" << std::endl;
+    for (size_t i=0; i < workers.size(); i++)
+      line("worker " + std::to_string(i), workers[i]);
+    line("total", total());
+  }
 };
 
 //thread_local int thread_id;
@@ -147,39 +270,54 @@ public:
 
   static thread_local int thread_id;
 
+  // Steals are tried first from workers sharing the thief's last level
+  // cache, then its numa node, then the whole machine.
+  enum { l3_level = 0, node_level = 1, machine_level = 2, num_levels = 3 };
+
   scheduler() {
     init_num_workers();
-    num_deques = 2*num_threads;
-    deques = new Deque<Job>[num_deques];
-    attempts = new attempt[num_deques];
-    finished_flag = 0;
-
-    // Spawn num_workers many threads on startup
-    spawned_threads = new std::thread[num_threads-1];
-    std::function<bool()> finished = [&] () {  return finished_flag == 1; };
+    init_steal_escalation();
+    // Space for the largest pool we can grow back to.
+    max_threads = num_threads;
+    deques = new_aligned_array<Deque<Job>>(2*max_threads);
+    attempts = new_aligned_array<attempt>(2*max_threads);
+    workers = new_aligned_array<worker_info>(max_threads);
+    spawned_threads = new std::thread[max_threads-1];
+    use_level[l3_level] = topo.num_l3 > 1;
+    use_level[node_level] = topo.num_nodes > 1 && topo.num_nodes < topo.num_l3;
+    use_level[machine_level] = true;
+    num_sleeping = 0;
+    num_idle = 0;
+    num_injected = 0;
+    init_arenas();
+    const char* stats_env = std::getenv("PBBS_SCHED_STATS");
+    stats_on = (stats_env != NULL && std::string(stats_env) != "0");
+    stats_start = clock::now();
+    init_affinity();
     thread_id = 0; // thread-local write
-    for (int i=1; i<num_threads; i++) {
-      spawned_threads[i-1] = std::thread([&, i, finished] () {
-        thread_id = i; // thread-local write
-        start(finished);
-      });
-    }
+    start_workers();
   }
 
   ~scheduler() {
-    finished_flag = 1;
-    for (int i=1; i<num_threads; i++) {
-      spawned_threads[i-1].join();
-    }
+    stop_workers();
     delete[] spawned_threads;
-    delete[] deques;
-    delete[] attempts;
+    delete_aligned_array(deques, 2*max_threads);
+    delete_aligned_array(attempts, 2*max_threads);
+    delete_aligned_array(workers, max_threads);
   }
 
   // Push onto local stack.
-  void spawn(Job* job) {
-    int id = worker_id();
+  void spawn(Job* job) { spawn(job, worker_id()); }
+
+  // As spawn, for a caller that already knows its worker_id().
+  void spawn(Job* job, int id) {
     deques[id].push_bottom(job);
+    // Pairs with the fence in sleep(): either the sleeper sees the job
+    // or we see the sleeper.  Without it a detached job (from
+    // fj.spawn) could sit in the deque while every other worker sleeps.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (num_sleeping.load(std::memory_order_relaxed) > 0 || stats_on)
+      spawn_slow(id);
   }
 
   // Wait for condition: finished().
@@ -196,7 +334,27 @@ public:
   }
 
   // All scheduler threads quit after this is called.
-  void finish() {finished_flag = 1;}
+  void finish() {
+    std::lock_guard<std::mutex> lock(sleep_lock);
+    finished_flag = 1;
+    sleep_cv.notify_all();
+  }
+
+  // Whether the local stack is empty.
+  bool local_empty() {
+    return deques[worker_id()].empty();
+  }
+
+  // Whether any worker is actively looking for work.
+  bool someone_stealing() {
+    return (num_idle.load(std::memory_order_relaxed) -
+	    num_sleeping.load(std::memory_order_relaxed)) > 0;
+  }
+
+  // Whether any worker is asleep waiting for work.
+  bool someone_sleeping() {
+    return num_sleeping.load(std::memory_order_relaxed) > 0;
+  }
 
   // Pop from local stack.
   Job* try_pop() {
@@ -215,60 +373,606 @@ public:
   int num_workers() {
     return num_threads;
   }
+  // -1 for threads that are not workers
   int worker_id() {
     return thread_id;
   }
-  void set_num_workers(int) {
-    std::cout << "Unsupported" << std::endl; exit(-1);
+
+  // Whether the calling thread is a worker.  Other threads have no
+  // deque of their own, so have to hand their work to the workers
+  // with inject.
+  bool is_worker() {
+    return thread_id >= 0;
+  }
+
+  // Adds a job from a thread that is not a worker.  It is taken by the
+  // next worker looking for work, whatever its arena.
+  void inject(Job* job) {
+    {
+      std::lock_guard<std::mutex> lock(inject_lock);
+      injected.push_back(job);
+      num_injected++;
+    }
+    wake_one();
+  }
+
+  // Grows or shrinks the pool.  All workers other than the caller are
+  // stopped and n-1 are restarted, reusing the deques.  Must be called
+  // from worker 0 (the main thread) when nothing is running in
+  // parallel.  Cannot grow beyond the initial number of workers since
+  // per worker state elsewhere (e.g. in block_allocator) is sized by it.
+  void set_num_workers(int n) {
+    if (n < 1 || n > max_threads)
+      throw std::invalid_argument("set_num_workers: number of workers must be in [1, "
+				  + std::to_string(max_threads) + "]");
+    if (worker_id() != 0)
+      throw std::runtime_error("set_num_workers: can only be called from worker 0");
+    if (multi_arena())
+      throw std::runtime_error("set_num_workers: cannot resize while there are arenas");
+    if (n == num_threads) return;
+    stop_workers();
+    num_threads = n;
+    compute_affinity(affinity_policy_str, reserved_str);
+    start_workers();
+  }
+
+  int max_workers() {
+    return max_threads;
+  }
+
+  // Number of successful steals at each level, summed over workers.
+  std::vector<size_t> steal_counts() {
+    std::vector<size_t> r(num_levels, 0);
+    for (int i=0; i < max_threads; i++)
+      for (int l=0; l < num_levels; l++)
+	r[l] += workers[i].steals[l].load(std::memory_order_relaxed);
+    return r;
+  }
+
+  // Only meaningful when no parallel work is running.
+  void reset_steal_counts() {
+    for (int i=0; i < max_threads; i++)
+      for (int l=0; l < num_levels; l++)
+	workers[i].steals[l] = 0;
+  }
+
+  // The remaining counters (jobs, failed steals, deque depth, idle and
+  // sleep time) are only collected when turned on, here or by setting
+  // PBBS_SCHED_STATS=1, and otherwise cost a predictable branch.
+  void enable_stats(bool on = true) { stats_on = on; }
+
+  // Counters for the current workers.  Can be called while work is
+  // running, in which case the numbers are approximate.
+  scheduler_stats stats() {
+    scheduler_stats r;
+    r.elapsed = std::chrono::duration<double>(clock::now() - stats_start).count();
+    for (int i=0; i < num_threads; i++) {
+      worker_info &w = workers[i];
+      scheduler_stats::worker x;
+      x.jobs_spawned = w.jobs_spawned.load(std::memory_order_relaxed);
+      x.jobs_run = w.jobs_run.load(std::memory_order_relaxed);
+      for (int l=0; l < num_levels; l++)
+	x.steals[l] = w.steals[l].load(std::memory_order_relaxed);
+      x.failed_steals = w.failed_steals.load(std::memory_order_relaxed);
+      x.max_depth = w.max_depth.load(std::memory_order_relaxed);
+      x.idle_time = w.idle_ns.load(std::memory_order_relaxed) / 1e9;
+      x.sleep_time = w.sleep_ns.load(std::memory_order_relaxed) / 1e9;
+      r.workers.push_back(x);
+    }
+    return r;
   }
 
+  // Only meaningful when no parallel work is running.
+  void reset_stats() {
+    reset_steal_counts();
+    for (int i=0; i < max_threads; i++) workers[i].reset();
+    stats_start = clock::now();
+  }
+
+  void print_stats() { stats().print(std::cout); }
+
+  // A thief makes escalation[l] consecutive attempts at level l before
+  // moving to level l+1, and after the machine level starts over.
+  // Levels that do not distinguish anything on this machine (e.g. the
+  // l3 level with a single L3) are skipped.
+  // Can also be set with PBBS_STEAL_ESCALATION=<l3>,<node>,<machine>.
+  void set_steal_escalation(int l3, int node, int machine) {
+    escalation[l3_level] = std::max(l3, 0);
+    escalation[node_level] = std::max(node, 0);
+    escalation[machine_level] = std::max(machine, 1);
+  }
+
+  // Places workers on cpus.  The policy is "none", "compact",
+  // "scatter", or an explicit cpu list such as "0-7,16-23" (see
+  // topology::placement).  Workers never use the reserved cpus (also a
+  // cpu list), which are left for other threads of the process.
+  // Applied at startup from PBBS_AFFINITY and PBBS_RESERVED_CPUS.
+  // Can be changed later, but only from worker 0 (the main thread)
+  // when nothing is running in parallel.
+  // Worker 0 is the thread that created the scheduler, and is never
+  // pinned, since threads it creates later would inherit its cpus; it
+  // can pin itself to cpus_of_worker(0).
+  void set_affinity(std::string const &policy,
+		    std::string const &reserved = "") {
+    compute_affinity(policy, reserved);
+    for (int i=1; i < num_threads; i++)
+      topology::pin_thread(spawned_threads[i-1], worker_cpus[i]);
+    for (int i=1; i < num_threads; i++)
+      workers[i].cpu = pinned ? worker_cpus[i][0] : -1;
+  }
+
+  // The cpus worker i is allowed to run on.
+  std::vector<int> const &cpus_of_worker(int i) { return worker_cpus[i]; }
+
+  // Arenas partition the workers into groups, so that work run in one
+  // arena (with execute) is only done by its own workers, the thread
+  // that called execute, and workers of arenas that lend.
+  // Arena 0 is the default, which has all the workers not given to
+  // other arenas, and in which everything runs unless told otherwise.
+  // When idle, workers of an arena that lends help other arenas,
+  // trying arenas of higher priority than their own first, so a low
+  // priority arena that lends its workers only keeps them busy when
+  // nothing more important is running.  Jobs are not preempted, so a
+  // worker that has started helping finishes the job it took first.
+  // With just the default arena stealing works as before.
+  static int const max_arenas = 16;
+
+  // Creates an arena of n workers taken from the default arena,
+  // returning its id.  At least one worker (worker 0) stays behind.
+  int create_arena(int n, int priority = 0, bool lend = true) {
+    std::lock_guard<std::mutex> lock(arena_lock);
+    int a = 1;
+    while (a < max_arenas && arenas[a].used) a++;
+    if (a == max_arenas)
+      throw std::runtime_error("create_arena: at most " +
+			       std::to_string(max_arenas) + " arenas");
+    std::vector<int> ws;
+    for (int i = num_threads-1; i > 0 && (int) ws.size() < n; i--)
+      if (workers[i].home == 0) ws.push_back(i);
+    if (n < 0 || (int) ws.size() < n)
+      throw std::invalid_argument("create_arena: only " + std::to_string(ws.size())
+				  + " workers are available");
+    arenas[a].priority = priority;
+    arenas[a].lend = lend;
+    arenas[a].active = 0;
+    arenas[a].used = true;
+    for (int i : ws) workers[i].home = a;
+    num_arenas++;
+    return a;
+  }
+
+  // Returns the arena's workers to the default arena.  Nothing should
+  // be running in the arena.
+  void destroy_arena(int a) {
+    std::lock_guard<std::mutex> lock(arena_lock);
+    check_arena(a, "destroy_arena");
+    if (a == 0) throw std::invalid_argument("destroy_arena: cannot destroy arena 0");
+    for (int i=0; i < max_threads; i++)
+      if (workers[i].home == a) workers[i].home = 0;
+    arenas[a].used = false;
+    num_arenas--;
+  }
+
+  // Changes the priority and lending of an arena, including arena 0.
+  void set_arena(int a, int priority, bool lend) {
+    check_arena(a, "set_arena");
+    arenas[a].priority = priority;
+    arenas[a].lend = lend;
+  }
+
+  // Runs f in arena a on the calling worker, so the jobs it forks
+  // belong to that arena, and waits for it.  Jobs the caller forked
+  // before calling execute that have not been stolen yet also count as
+  // in arena a until it returns.
+  template <typename F>
+  void execute(int a, F f) {
+    check_arena(a, "execute");
+    int id = worker_id();
+    int prev = workers[id].arena.load(std::memory_order_relaxed);
+    set_label(id, a);
+    arenas[a].active++;
+    auto restore = [&] () {
+      arenas[a].active--;
+      set_label(id, prev);
+    };
+    try { f(); }
+    catch (...) { restore(); throw; }
+    restore();
+  }
+
+  // The workers whose home is arena a.
+  std::vector<int> workers_of_arena(int a) {
+    std::vector<int> r;
+    for (int i=0; i < num_threads; i++)
+      if (workers[i].home == a) r.push_back(i);
+    return r;
+  }
+
+  topology topo;
+
 private:
 
+  using clock = std::chrono::steady_clock;
+
   // Align to avoid false sharing.
   struct alignas(128) attempt { size_t val; };
 
+  // Per worker state, aligned to avoid false sharing.
+  // The counters are only written by the worker itself, so they are
+  // atomic just so that stats() can read them while running.
+  struct alignas(128) worker_info {
+    std::atomic<int> cpu; // cpu last seen running on, -1 if unknown
+    std::atomic<int> home; // arena the worker belongs to
+    std::atomic<int> arena; // arena of the work it is running
+    std::atomic<size_t> steals[num_levels];
+    std::atomic<size_t> jobs_spawned, jobs_run, failed_steals, max_depth;
+    std::atomic<uint64_t> idle_ns, sleep_ns;
+    worker_info() : cpu(-1), home(0), arena(0) {
+      for (int l=0; l < num_levels; l++) steals[l] = 0;
+      reset();
+    }
+    void reset() {
+      jobs_spawned = jobs_run = failed_steals = max_depth = 0;
+      idle_ns = sleep_ns = 0;
+    }
+    static void inc(std::atomic<size_t> &x, size_t v = 1) {
+      x.store(x.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+    }
+    static void add_time(std::atomic<uint64_t> &x, clock::duration d) {
+      x.store(x.load(std::memory_order_relaxed) +
+	      std::chrono::duration_cast<std::chrono::nanoseconds>(d).count(),
+	      std::memory_order_relaxed);
+    }
+  };
+
+  bool stats_on;
+  clock::time_point stats_start;
+  int max_threads;
   int num_deques;
   Deque<Job>* deques;
   attempt* attempts;
+  worker_info* workers;
+  bool use_level[num_levels];
+  int escalation[num_levels];
+  bool pinned; // each worker on its own cpu, known in advance
+  bool restricted; // need to set the affinity of workers at startup
+  std::vector<std::vector<int>> worker_cpus;
+  std::string affinity_policy_str, reserved_str;
   std::thread* spawned_threads;
-  int finished_flag;
+  std::atomic<int> finished_flag;
+
+  struct arena_info {
+    std::atomic<bool> used;
+    std::atomic<int> priority;
+    std::atomic<bool> lend;
+    std::atomic<int> active; // executes in progress
+  };
+  arena_info arenas[max_arenas];
+  std::atomic<int> num_arenas;
+  std::mutex arena_lock;
+
+  // Idle workers park on sleep_cv (a futex on Linux) rather than spin.
+  std::mutex sleep_lock;
+  std::condition_variable sleep_cv;
+  std::atomic<int> num_sleeping;
+  std::atomic<int> num_idle; // workers in steal_job, including sleepers
+
+  // Jobs from threads that are not workers, see inject.
+  std::mutex inject_lock;
+  std::deque<Job*> injected;
+  alignas(64) std::atomic<int> num_injected;
+
+  // Spawn num_workers-1 threads, the caller being worker 0.
+  void start_workers() {
+    num_deques = 2*num_threads;
+    finished_flag = 0;
+    std::function<bool()> finished = [&] () {  return finished_flag == 1; };
+    for (int i=1; i<num_threads; i++) {
+      spawned_threads[i-1] = std::thread([&, i, finished] () {
+        thread_id = i; // thread-local write
+        if (restricted) pin_worker(i);
+        start(finished, true);
+      });
+    }
+  }
+
+  void stop_workers() {
+    finish();
+    for (int i=1; i<num_threads; i++) {
+      spawned_threads[i-1].join();
+    }
+  }
+
+  // Kept out of line so it does not slow down forking.
+  __attribute__((noinline)) void spawn_slow(int id) {
+    if (num_sleeping.load(std::memory_order_relaxed) > 0) {
+      // the one woken might not be allowed to take the job
+      if (multi_arena()) wake_all();
+      else wake_one();
+    }
+    if (!stats_on) return;
+    worker_info &w = workers[id];
+    worker_info::inc(w.jobs_spawned);
+    size_t depth = deques[id].size();
+    if (depth > w.max_depth.load(std::memory_order_relaxed))
+      w.max_depth.store(depth, std::memory_order_relaxed);
+  }
 
   // Start an individual scheduler task.  Runs until finished().
+  // Only the top level loop of a worker (top_level = true) goes to
+  // sleep when there is no work, since a nested wait is waiting on a
+  // stolen job that will not wake it up when done.
   template <typename F>
-  void start(F finished) {
+  void start(F finished, bool top_level=false) {
+    int id = worker_id();
     while (1) {
-      Job* job = get_job(finished);
+      // a stolen job can be from another arena, so switch back after,
+      // and a worker that is not running anything is in its home arena
+      if (top_level)
+	set_label(id, workers[id].home.load(std::memory_order_relaxed));
+      int a = workers[id].arena.load(std::memory_order_relaxed);
+      Job* job = get_job(finished, top_level);
       if (!job) return;
+      if (stats_on) worker_info::inc(workers[id].jobs_run);
       (*job)();
+      set_label(id, a);
+    }
+  }
+
+  void init_arenas() {
+    for (int a=0; a < max_arenas; a++) {
+      arenas[a].used = (a == 0);
+      arenas[a].priority = 0;
+      arenas[a].lend = true;
+      arenas[a].active = 0;
+    }
+    num_arenas = 1;
+  }
+
+  bool multi_arena() {
+    return num_arenas.load(std::memory_order_relaxed) > 1;
+  }
+
+  void check_arena(int a, std::string const &fn) {
+    if (a < 0 || a >= max_arenas || !arenas[a].used)
+      throw std::invalid_argument(fn + ": no arena " + std::to_string(a));
+  }
+
+  // Changes the arena of the jobs worker id forks.  Thieves check the
+  // arena of a deque while stealing from it (see try_steal), and a steal
+  // that checked the old arena must not get a job forked under the new
+  // one.  The deque is empty here unless execute was called from within
+  // parallel code, in which case the jobs already in it change arena.
+  void set_label(int id, int a) {
+    std::atomic<int> &arena = workers[id].arena;
+    if (arena.load(std::memory_order_relaxed) == a) return;
+    arena.store(a, std::memory_order_seq_cst);
+    if (deques[id].empty()) deques[id].invalidate_top();
+  }
+
+  // Whether worker id can steal from a worker in arena a, only taking
+  // from arenas with at least the given priority.
+  bool may_steal(size_t id, int a, int min_priority) {
+    if (arenas[a].priority.load(std::memory_order_relaxed) < min_priority)
+      return false;
+    int home = workers[id].home.load(std::memory_order_relaxed);
+    return (a == home || a == workers[id].arena.load(std::memory_order_relaxed) ||
+	    arenas[home].lend.load(std::memory_order_relaxed));
+  }
+
+  // The priority a lending worker should look for first: above its
+  // own if a higher priority arena is running something.
+  int preferred_priority(size_t id) {
+    int home = workers[id].home.load(std::memory_order_relaxed);
+    if (!arenas[home].lend.load(std::memory_order_relaxed)) return INT_MIN;
+    int p = arenas[home].priority.load(std::memory_order_relaxed);
+    for (int a=0; a < max_arenas; a++)
+      if (arenas[a].used.load(std::memory_order_relaxed) &&
+	  arenas[a].active.load(std::memory_order_relaxed) > 0 &&
+	  arenas[a].priority.load(std::memory_order_relaxed) > p)
+	return p + 1;
+    return INT_MIN;
+  }
+
+  void init_affinity() {
+    const char* policy = std::getenv("PBBS_AFFINITY");
+    const char* reserved = std::getenv("PBBS_RESERVED_CPUS");
+    compute_affinity(policy ? policy : "", reserved ? reserved : "");
+  }
+
+  void compute_affinity(std::string const &policy,
+			std::string const &reserved) {
+    affinity_policy_str = policy;
+    reserved_str = reserved;
+    std::vector<int> cpu_list;
+    std::vector<int> res = topology::parse_cpu_list(reserved);
+    auto p = topology::parse_policy(policy, cpu_list);
+    std::vector<int> place = topo.placement(p, num_threads, res, cpu_list);
+    pinned = !place.empty();
+    restricted = pinned || !res.empty();
+    // if not pinned, can run on any allowed cpu that is not reserved
+    std::vector<int> any;
+    for (int c : topo.allowed)
+      if (std::find(res.begin(), res.end(), c) == res.end()) any.push_back(c);
+    if (any.empty()) any = topo.allowed;
+    worker_cpus.assign(num_threads, any);
+    for (int i=0; i < (int) place.size(); i++)
+      worker_cpus[i] = {place[i]};
+  }
+
+  // Must be called by worker i itself.
+  void pin_worker(int i) {
+    topology::pin_current_thread(worker_cpus[i]);
+    if (pinned) workers[i].cpu = worker_cpus[i][0];
+  }
+
+  void init_steal_escalation() {
+    set_steal_escalation(8, 8, 4);
+    if (const char* env_p = std::getenv("PBBS_STEAL_ESCALATION")) {
+      std::string s(env_p);
+      int e[num_levels] = {8, 8, 4};
+      size_t pos = 0;
+      for (int l=0; l < num_levels && pos < s.size(); l++) {
+	size_t next = s.find(',', pos);
+	e[l] = std::stoi(s.substr(pos, next - pos));
+	pos = (next == std::string::npos) ? s.size() : next + 1;
+      }
+      set_steal_escalation(e[0], e[1], e[2]);
     }
   }
 
-  Job* try_steal(size_t id) {
+  // Level to steal from on the i-th attempt of a round.
+  int steal_level(int i) {
+    int period = 0;
+    for (int l=0; l < num_levels; l++)
+      if (use_level[l]) period += escalation[l];
+    i = i % period;
+    for (int l=0; l < num_levels; l++)
+      if (use_level[l]) {
+	if (i < escalation[l]) return l;
+	i -= escalation[l];
+      }
+    return machine_level;
+  }
+
+  bool same_domain(int level, int cpu1, int cpu2) {
+    if (level == l3_level)
+      return topo.l3_of(cpu1) >= 0 && topo.l3_of(cpu1) == topo.l3_of(cpu2);
+    return topo.node_of(cpu1) >= 0 && topo.node_of(cpu1) == topo.node_of(cpu2);
+  }
+
+  Job* try_steal(size_t id, int level, int cpu, bool multi, int min_priority) {
     // use hashing to get "random" target
     size_t target = (hash(id) + hash(attempts[id].val)) % num_deques;
     attempts[id].val++;
-    return deques[target].pop_top();
+    // For the local levels sample until we hit a worker in the same
+    // domain, giving up after a few tries.  Similarly with arenas for
+    // a worker we are allowed to steal from.
+    if (level != machine_level || multi) {
+      int k = 0;
+      while (target >= (size_t) num_threads || target == id ||
+	     (level != machine_level &&
+	      !same_domain(level, cpu, workers[target].cpu.load(std::memory_order_relaxed))) ||
+	     (multi && !may_steal(id, workers[target].arena.load(std::memory_order_relaxed),
+				  min_priority))) {
+	if (++k == 8) return NULL;
+	target = (hash(id) + hash(attempts[id].val)) % num_threads;
+	attempts[id].val++;
+      }
+    }
+    Job* job;
+    if (multi) {
+      // check again as part of the steal, and take on the arena of the job
+      int a;
+      job = deques[target].pop_top_if([&] () {
+	  a = workers[target].arena.load(std::memory_order_relaxed);
+	  return may_steal(id, a, min_priority);});
+      if (job) set_label(id, a);
+    } else job = deques[target].pop_top();
+    if (job) worker_info::inc(workers[id].steals[level]);
+    else if (stats_on) worker_info::inc(workers[id].failed_steals);
+    return job;
   }
 
   // Find a job, first trying local stack, then random steals.
   template <typename F>
-  Job* get_job(F finished) {
+  Job* get_job(F finished, bool top_level) {
     if (finished()) return NULL;
     Job* job = try_pop();
     if (job) return job;
+    num_idle.fetch_add(1);
+    if (!stats_on) job = steal_job(finished, top_level);
+    else {
+      auto t = clock::now();
+      job = steal_job(finished, top_level);
+      worker_info::add_time(workers[worker_id()].idle_ns, clock::now() - t);
+    }
+    num_idle.fetch_sub(1);
+    return job;
+  }
+
+  template <typename F>
+  Job* steal_job(F finished, bool top_level) {
+    Job* job;
     size_t id = worker_id();
     while (1) {
+      // If workers are not tied to cpus (worker 0 never is), find out
+      // where we are now.
+      int cpu;
+      if (pinned && id != 0) cpu = workers[id].cpu.load(std::memory_order_relaxed);
+      else {
+	cpu = topo.current_cpu();
+	workers[id].cpu.store(cpu, std::memory_order_relaxed);
+      }
       // By coupon collector's problem, this should touch all.
+      // With arenas, the first half of the attempts are only on higher
+      // priority arenas if any are running.
+      bool multi = multi_arena();
+      int min_priority = multi ? preferred_priority(id) : INT_MIN;
       for (int i=0; i <= num_deques * 100; i++) {
 	if (finished()) return NULL;
-	job = try_steal(id);
+	if ((job = take_injected())) return job;
+	if (i == num_deques * 50) min_priority = INT_MIN;
+	job = try_steal(id, steal_level(i), cpu, multi, min_priority);
 	if (job) return job;
       }
-      // If haven't found anything, take a breather.
-      std::this_thread::sleep_for(std::chrono::nanoseconds(num_deques*100));
+      // If haven't found anything, go to sleep, or if in a nested
+      // wait, take a breather.
+      if (top_level) sleep();
+      else std::this_thread::sleep_for(std::chrono::nanoseconds(num_deques*100));
     }
   }
 
+  Job* take_injected() {
+    if (num_injected.load(std::memory_order_relaxed) == 0) return NULL;
+    std::lock_guard<std::mutex> lock(inject_lock);
+    if (injected.empty()) return NULL;
+    Job* job = injected.front();
+    injected.pop_front();
+    num_injected--;
+    return job;
+  }
+
+  bool work_available() {
+    if (num_injected.load() > 0) return true;
+    bool multi = multi_arena();
+    for (int i=0; i < num_deques; i++)
+      if (!deques[i].empty() &&
+	  (!multi || (i < num_threads &&
+		      may_steal(worker_id(), workers[i].arena.load(std::memory_order_relaxed),
+				INT_MIN))))
+	return true;
+    return false;
+  }
+
+  // Block until woken by spawn or finish.  The check for work is made
+  // after announcing ourselves in num_sleeping so that a spawn that is
+  // not concurrent with this either sees us or we see its job.
+  void sleep() {
+    std::unique_lock<std::mutex> lock(sleep_lock);
+    num_sleeping.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (finished_flag == 0 && !work_available()) {
+      if (!stats_on) sleep_cv.wait(lock);
+      else {
+	auto t = clock::now();
+	sleep_cv.wait(lock);
+	worker_info::add_time(workers[worker_id()].sleep_ns, clock::now() - t);
+      }
+    }
+    num_sleeping.fetch_sub(1);
+  }
+
+  void wake_one() {
+    std::lock_guard<std::mutex> lock(sleep_lock);
+    sleep_cv.notify_one();
+  }
+
+  void wake_all() {
+    std::lock_guard<std::mutex> lock(sleep_lock);
+    sleep_cv.notify_all();
+  }
+
   uint64_t hash(uint64_t x) {
     x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
     x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
@@ -278,24 +982,61 @@ private:
 };
 
 template<typename T>
-thread_local int scheduler<T>::thread_id = 0;
+thread_local int scheduler<T>::thread_id = -1;
 
 struct fork_join_scheduler {
 
 public:
   // Jobs are thunks -- i.e., functions that take no arguments
   // and return nothing.   Could be a lambda, e.g. [] () {}.
-  using Job = std::function<void()>;
+  // A Job is just a pointer to a function that knows the real type of
+  // the job_frame it is embedded in, so it can live on the stack of
+  // the forking function and forking never allocates.
+  struct Job {
+    void operator()() { run(this); }
+  protected:
+    Job(void (*run)(Job*)) : run(run) {}
+  private:
+    void (*run)(Job*);
+  };
+
+  // Holds the thunk f in place.
+  template <typename F>
+  struct job_frame : Job {
+    F f;
+    job_frame(F f) : Job(execute), f(std::move(f)) {}
+  private:
+    static void execute(Job* job) {
+      static_cast<job_frame*>(job)->f();
+    }
+  };
+
+  template <typename F>
+  static job_frame<F> make_job(F f) { return job_frame<F>(std::move(f)); }
+
+  // A job on the heap that frees itself after it runs, for jobs that
+  // outlive the function that spawns them.
+  template <typename F>
+  struct detached_job : Job {
+    F f;
+    detached_job(F f) : Job(execute), f(std::move(f)) {}
+  private:
+    static void execute(Job* job) {
+      detached_job* self = static_cast<detached_job*>(job);
+      self->f();
+      delete self;
+    }
+  };
 
   scheduler<Job>* sched;
 
   fork_join_scheduler() {
-    sched = new scheduler<Job>;
+    sched = new_aligned_array<scheduler<Job>>(1);
   }
 
   ~fork_join_scheduler() {
     if (sched) {
-      delete sched;
+      delete_aligned_array(sched, 1);
       sched = nullptr;
     }
   }
@@ -303,65 +1044,224 @@ public:
   // Must be called using std::atexit(..) to free resources
   void destroy() {
     if (sched) {
-      delete sched;
+      delete_aligned_array(sched, 1);
       sched = nullptr;
     }
   }
 
   int num_workers() { return sched->num_workers(); }
+  int max_workers() { return sched->max_workers(); }
   int worker_id() { return sched->worker_id(); }
   void set_num_workers(int n) { sched->set_num_workers(n); }
 
+  // Runs f asynchronously: it goes on the deque like the right side of
+  // a pardo, but nothing waits for it, so the caller has to arrange to
+  // be told when it is done (see future.h).  f should not throw.
+  template <typename F>
+  void spawn(F f) {
+    if (sched->is_worker()) sched->spawn(new detached_job<F>(std::move(f)));
+    else if (serial_external()) f();
+    else sched->inject(new detached_job<F>(std::move(f)));
+  }
+
+  // Waits until finished() is true, running other jobs in the meantime
+  // (threads that are not workers just yield).
+  template <typename F>
+  void wait_until(F finished, bool conservative=false) {
+    sched->wait(finished, conservative || !sched->is_worker());
+  }
+
+  // Runs f in arena a (see scheduler::execute).
+  template <typename F>
+  void execute(int a, F f) {
+    if (sched->is_worker()) sched->execute(a, f);
+    else if (serial_external()) f();
+    else run_external([&] () {sched->execute(a, f);});
+  }
+
+  // Threads that are not workers (e.g. the request threads of a server)
+  // can call any of the functions here concurrently.  The call is handed
+  // to the workers as a job, and the thread blocks until it is done,
+  // getting any exception it throws.  With a single worker, which is
+  // the main thread and could itself be blocked, the call instead runs
+  // sequentially on the calling thread.
+  template <typename F>
+  void run_external(F f) {
+    std::mutex m;
+    std::condition_variable cv;
+    bool done = false;
+    std::exception_ptr e;
+    auto job = make_job([&] () {
+      try { f(); }
+      catch (...) { e = std::current_exception(); }
+      // notify under the lock, since cv goes away once done is seen
+      std::lock_guard<std::mutex> lock(m);
+      done = true;
+      cv.notify_one();});
+    sched->inject(&job);
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [&] () {return done;});
+    if (e) std::rethrow_exception(e);
+  }
+
   // Fork two thunks and wait until they both finish.
+  // If either throws, the exception is rethrown here after both are
+  // done (the left one if both throw).  If the left one throws before
+  // the right one is stolen, the right one is never run.
   template <typename L, typename R>
   void pardo(L left, R right, bool conservative=false) {
-    bool right_done = false;
-    Job right_job = [&] () {
-      right(); right_done = true;};
-    sched->spawn(&right_job);
-    left();
-    if (sched->try_pop() != NULL) right();
+    int id = sched->worker_id();
+    if (__builtin_expect(id < 0, 0))
+      return pardo_external(left, right, conservative);
+    std::atomic<bool> right_done(false);
+    std::exception_ptr right_exception;
+    auto right_job = make_job([&] () {
+      try { right(); }
+      catch (...) { right_exception = std::current_exception(); }
+      right_done.store(true, std::memory_order_release);});
+    sched->spawn(&right_job, id);
+    try { left(); }
+    catch (...) {
+      // the right job refers to this frame, so cannot leave until it is
+      // either taken back or finished
+      if (!take_back(&right_job)) wait_for(right_done, conservative);
+      throw;
+    }
+    if (take_back(&right_job)) right();
     else {
-      auto finished = [&] () {return right_done;};
-      sched->wait(finished, conservative);
+      wait_for(right_done, conservative);
+      if (right_exception) std::rethrow_exception(right_exception);
     }
   }
 
-  template <typename F>
-  int get_granularity(size_t start, size_t end, F f) {
-    size_t done = 0;
-    size_t size = 1;
-    int ticks;
-    do {
-      size = std::min(size,end-(start+done));
-      auto tstart = std::chrono::high_resolution_clock::now();
-      for (size_t i=0; i < size; i++) f(start+done+i);
-      auto tstop = std::chrono::high_resolution_clock::now();
-      ticks = (tstop-tstart).count();
-      done += size;
-      size *= 2;
-    } while (ticks < 1000 && done < (end-start));
-    return done;
-  }
-
+  // If granularity is 0 the loop is split lazily (see parfor_lazy),
+  // otherwise it is eagerly split into blocks of at most granularity.
   template <typename F>
   void parfor(size_t start, size_t end, F f,
 	      size_t granularity = 0,
 	      bool conservative = false) {
+    parfor_until(start, end, f, never_stop(), granularity, conservative);
+  }
+
+  // As parfor, but the iterations from i on are skipped once stop(i)
+  // is true, which is checked between chunks of iterations.
+  // stop must be monotone: once stop(i) is true so is stop(j) for j > i.
+  template <typename F, typename S>
+  void parfor_until(size_t start, size_t end, F f, S stop,
+		    size_t granularity = 0,
+		    bool conservative = false) {
     if (end <= start) return;
-    if (granularity == 0) {
-      size_t done = get_granularity(start,end, f);
-      granularity = std::max(done, (end-start)/(128*sched->num_threads));
-      parfor_(start+done, end, f, granularity, conservative);
-    } else parfor_(start, end, f, granularity, conservative);
+    if (!sched->is_worker()) {
+      if (serial_external())
+	for (size_t i=start; i < end && !stop(i); i++) f(i);
+      else run_external([&] () {
+	  parfor_until(start, end, f, stop, granularity, conservative);});
+      return;
+    }
+    if (granularity == 0) parfor_lazy(start, end, f, stop, conservative);
+    else parfor_(start, end, f, stop, granularity, conservative);
   }
 
 private:
 
-  template <typename F>
-  void parfor_(size_t start, size_t end, F f,
+  bool serial_external() { return sched->num_workers() == 1; }
+
+  // Kept out of line so it does not slow down forking.
+  template <typename L, typename R>
+  __attribute__((noinline)) void pardo_external(L& left, R& right, bool conservative) {
+    if (serial_external()) {left(); right();}
+    else run_external([&] () {pardo(left, right, conservative);});
+  }
+
+  // for loops that cannot be stopped, compiles away
+  struct never_stop {
+    bool operator()(size_t) const { return false; }
+  };
+
+  // Most iterations run between checks for whether to split.
+  static size_t const lazy_chunk = 64;
+
+  // How long (in microseconds) a loop must have run before it wakes a
+  // sleeping worker.
+  static long const lazy_wake_delay = 10;
+
+  // Lazy binary splitting (Tzannes, Caragea, Barua and Vishkin, PPoPP
+  // 2010).  Runs iterations in chunks, and only splits off the second
+  // half of what remains when the local deque is empty and some worker
+  // is looking for work.  Since the deque is only empty once the
+  // previously split off half has been stolen, a loop is split about as
+  // often as there are thieves, and the granularity adapts to the cost
+  // of the iterations without any timing.  If the other workers are
+  // all asleep, it only splits (waking one) once the loop has run for
+  // lazy_wake_delay, so short loops never pay for a wake up.
+  // Chunks start at one iteration and double up to lazy_chunk, but are
+  // never more than an eighth of what remains, so loops with a few
+  // expensive iterations still get split.
+  template <typename F, typename S>
+  void parfor_lazy(size_t start, size_t end, F& f, S& stop,
+		   bool conservative) {
+    using clock = std::chrono::steady_clock;
+    size_t chunk = 1;
+    lazy_timer<clock::time_point> timer;
+    while (start < end && !stop(start)) {
+      if (end - start > 1 && sched->local_empty() && split_now(timer)) {
+	size_t mid = start + (end - start)/2;
+	pardo([&] () {parfor_lazy(start, mid, f, stop, conservative);},
+	      [&] () {parfor_lazy(mid, end, f, stop, conservative);},
+	      conservative);
+	return;
+      }
+      size_t chunk_end = start + std::max<size_t>(1, std::min(chunk, (end - start)/8));
+      for (size_t i=start; i < chunk_end; i++) f(i);
+      timer.done += chunk_end - start;
+      start = chunk_end;
+      chunk = std::min(2*chunk, lazy_chunk);
+    }
+  }
+
+  // Pops the job back off the local deque, returning false if it was
+  // stolen.  Jobs spawned with spawn(f) can be above it, in which
+  // case they are run first.
+  bool take_back(Job* job) {
+    Job* top;
+    while ((top = sched->try_pop()) != NULL && top != job) (*top)();
+    return top != NULL;
+  }
+
+  void wait_for(std::atomic<bool> &done, bool conservative) {
+    auto finished = [&] () {return done.load(std::memory_order_acquire);};
+    sched->wait(finished, conservative);
+  }
+
+  // How long a loop has run, for deciding whether to wake a sleeper.
+  // Reading the clock costs as much as a short chunk, and a loop of a
+  // few thousand cheap iterations runs dozens of chunks, so after the
+  // first reading it is only read again each time the number of
+  // iterations run doubles.
+  template <typename T>
+  struct lazy_timer {
+    bool started = false;
+    T t0;
+    size_t done = 0;
+    size_t next = 1;
+  };
+
+  template <typename T>
+  bool split_now(lazy_timer<T> &timer) {
+    if (sched->someone_stealing()) return true;
+    if (!sched->someone_sleeping()) return false;
+    if (timer.started && timer.done < timer.next) return false;
+    auto now = std::chrono::steady_clock::now();
+    if (!timer.started) {timer.started = true; timer.t0 = now; return false;}
+    timer.next = 2 * timer.done;
+    return now - timer.t0 > std::chrono::microseconds((long) lazy_wake_delay);
+  }
+
+  template <typename F, typename S>
+  void parfor_(size_t start, size_t end, F& f, S& stop,
 	       size_t granularity,
 	       bool conservative) {
+    if (stop(start)) return;
     if ((end - start) <= granularity)
       for (size_t i=start; i < end; i++) f(i);
     else {
@@ -369,8 +1269,8 @@ private:
       // Not in middle to avoid clashes on set-associative caches
       // on powers of 2.
       size_t mid = (start + (9*(n+1))/16);
-      pardo([&] () {parfor_(start, mid, f, granularity, conservative);},
-	    [&] () {parfor_(mid, end, f, granularity, conservative);},
+      pardo([&] () {parfor_(start, mid, f, stop, granularity, conservative);},
+	    [&] () {parfor_(mid, end, f, stop, granularity, conservative);},
 	    conservative);
     }
   }
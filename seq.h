@@ -162,6 +162,16 @@ namespace pbbs {
 	  assign_uninitialized<value_type>(start[i], f(i));}, granularity);
     };
 
+    // as above, with the memory placed on numa nodes as given (before
+    // it is touched, see memory_placement.h)
+    template <typename Func>
+    sequence(const size_t sz, Func f, memory_placement m, size_t granularity=300) {
+      value_type* start = alloc_no_init(sz);
+      if (!is_small()) place_memory(start, sz * sizeof(value_type), m);
+      parallel_for(0, sz, [&] (size_t i) {
+	  assign_uninitialized<value_type>(start[i], f(i));}, granularity);
+    };
+
     // construct a sequence from initializer list
     sequence(std::initializer_list<value_type> l) {
       size_t sz = l.end() - l.begin();
@@ -190,6 +200,13 @@ namespace pbbs {
       return r;
     };
 
+    static sequence<value_type> no_init(const size_t sz, memory_placement m) {
+      sequence<value_type> r;
+      value_type* start = r.alloc_no_init(sz);
+      if (!r.is_small()) place_memory(start, sz * sizeof(value_type), m);
+      return r;
+    };
+
     // Constructs a sequence by taking ownership of an
     // allocated value_type array.
     // Only use if a is allocated by the same allocator as 
@@ -381,7 +398,7 @@ namespace pbbs {
     return sequence<decltype(f(0))>(n,f);
   }
 
-  std::ostream& operator<<(std::ostream& os, sequence<char> const &s)
+  inline std::ostream& operator<<(std::ostream& os, sequence<char> const &s)
   {
     // pad with a zero
     sequence<char> out(s.size()+1, [&] (size_t i) {
@@ -14,20 +14,31 @@ namespace pbbs {
     return r;
   }
 
+  // Returns an index i < n for which p(i) is true, or n if there is none.
+  // If first is set it is the smallest such index, otherwise any.
+  // Works in rounds of doubling size so the work is proportional to
+  // where the match is rather than to n.  Within a round the iterations
+  // past a match are cancelled (all of them if not first).
   template<class IntegerPred>
-  size_t find_if_index(size_t n, IntegerPred p, size_t granularity=1000) {
+  size_t find_if_index_(size_t n, IntegerPred p, size_t granularity,
+			bool first) {
     size_t i;
     for (i = 0; i < std::min(granularity, n); i++)
       if (p(i)) return i;
     if (i == n) return n;
     size_t start = granularity;
     size_t block_size = 2 * granularity;
+    cancellation_token tok;
     i = n;
     while (start < n) {
       size_t end = std::min(n, start + block_size);
       parallel_for(start, end, [&] (size_t j) {
-	  if (p(j)) write_min(&i, j, std::less<size_t>());
-	}, granularity);
+	  if (!tok.cancelled(j) && p(j)) {
+	    write_min(&i, j, std::less<size_t>());
+	    if (first) tok.cancel_from(j);
+	    else tok.cancel();
+	  }
+	}, tok, granularity);
       if (i < n) return i;
       start += block_size;
       block_size *= 2;
@@ -35,6 +46,15 @@ namespace pbbs {
     return n;
   }
 
+  template<class IntegerPred>
+  size_t find_if_index(size_t n, IntegerPred p, size_t granularity=1000) {
+    return find_if_index_(n, p, granularity, true);}
+
+  // as find_if_index but returns any index that satisfies p
+  template<class IntegerPred>
+  size_t find_any_index(size_t n, IntegerPred p, size_t granularity=1000) {
+    return find_if_index_(n, p, granularity, false);}
+
   template<class Seq, class UnaryFunction>
   void for_each(Seq const &S, UnaryFunction f) {
     parallel_for(S.size(), [&] (size_t i) {f(S[i]);});}
@@ -48,13 +68,17 @@ namespace pbbs {
     return count_if_index(S.size(), [&] (size_t i) {return S[i] == value;});}
 
   template<class Seq, class UnaryPred>
-  bool all_of(Seq const &S, UnaryPred p) { return count_if(S, p) == S.size();}
+  bool all_of(Seq const &S, UnaryPred p) {
+    return find_any_index(S.size(), [&] (size_t i) {
+	return !p(S[i]);}) == S.size();}
 
   template<class Seq, class UnaryPred>
-  bool any_of(Seq const &S, UnaryPred p) { return count_if(S, p) > 1;}
+  bool any_of(Seq const &S, UnaryPred p) {
+    return find_any_index(S.size(), [&] (size_t i) {
+	return p(S[i]);}) < S.size();}
 
   template<class Seq, class UnaryPred>
-  bool none_of(Seq const &S, UnaryPred p) { return count_if(S, p) == 0;}
+  bool none_of(Seq const &S, UnaryPred p) { return !any_of(S, p);}
 
   template<class Seq, class UnaryPred>
   size_t find_if(Seq const &S, UnaryPred p) {
@@ -72,7 +96,7 @@ namespace pbbs {
   size_t find_first_of(Seq1 const &S1, Seq2 const &S2, BinaryPred p) {
     return find_if_index(S1.size(), [&] (size_t i) {
 	size_t j;
-	for (size_t j; j < S2.size(); j++)
+	for (j=0; j < S2.size(); j++)
 	  if (p(S1[i], S2[j])) break;
 	return (j < S2.size());});
   }
@@ -87,7 +111,7 @@ namespace pbbs {
     return find_if_index(S.size()-1, [&] (size_t i) {
 	return S[i] == S[i+1];});}
 
-  template<class Seq, class BinaryPred>
+  template<class Seq>
   size_t mismatch(Seq const &S1, Seq const &S2) {
     return find_if_index(std::min(S1.size(),S2.size()), [&] (size_t i) {
 	return S1[i] != S2[i];});}
@@ -210,7 +234,7 @@ namespace pbbs {
   template <class Seq, class Compare>
   size_t is_sorted_until(Seq const &S, Compare comp) {
     return find_if_index(S.size()-1, [&] (size_t i) {
-	comp(S[i+1],S[i]);}) + 1;}
+	return comp(S[i+1],S[i]);}) + 1;}
 
   template <class Seq, class UnaryPred>
   size_t is_partitioned(Seq const &S, UnaryPred f) {
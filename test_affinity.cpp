@@ -0,0 +1,91 @@
+#include <sched.h>
+#include <thread>
+#include <mutex>
+#include "get_time.h"
+#include "parse_command_line.h"
+#include "utilities.h"
+#include "test_check.h"
+
+// Checks the affinity policies of the scheduler: that workers run on
+// the cpus set for them, avoiding reserved cpus, and that the main
+// thread, and threads it creates later, keep the cpus they started
+// with, both after set_affinity and after the workers are restarted.
+
+// the cpus the calling thread may run on
+std::vector<int> thread_cpus() {
+  std::vector<int> r;
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) != 0) return r;
+  for (int c = 0; c < CPU_SETSIZE; c++)
+    if (CPU_ISSET(c, &set)) r.push_back(c);
+  return r;
+}
+
+std::string cpu_list(std::vector<int> const &cpus) {
+  std::string s;
+  for (int c : cpus) s += (s.empty() ? "" : ",") + std::to_string(c);
+  return s;
+}
+
+// the cpus of each worker other than 0 that ran some iteration
+std::vector<std::vector<int>> worker_cpus(size_t n) {
+  std::vector<std::vector<int>> r(num_workers());
+  std::mutex lock;
+  parallel_for(0, n, [&] (size_t) {
+      int id = worker_id();
+      if (id > 0) {
+	std::vector<int> cpus = thread_cpus();
+	std::lock_guard<std::mutex> g(lock);
+	r[id] = cpus;
+      }
+      for (volatile int j=0; j < 20000; j++);}, 1);
+  return r;
+}
+
+void check(std::string const &policy, std::vector<int> const &reserved,
+	   std::vector<int> const &main_cpus) {
+  std::string name = policy + (reserved.empty() ? "" : " reserved " + cpu_list(reserved));
+  auto sched = fj.sched;
+  int p = num_workers();
+  sched->set_affinity(policy, cpu_list(reserved));
+  for (int restart = 0; restart < 2; restart++) {
+    std::string when = name + (restart ? " restarted" : "");
+    expect(thread_cpus() == main_cpus, when + ": main thread not pinned");
+    std::vector<int> child;
+    std::thread t([&] () {child = thread_cpus();});
+    t.join();
+    expect(child == main_cpus, when + ": new thread not pinned");
+    std::vector<std::vector<int>> seen = worker_cpus(100 * p);
+    for (int i = 1; i < p; i++) {
+      std::vector<int> const &cpus = sched->cpus_of_worker(i);
+      if (policy != "none") expect(cpus.size() == 1, when + ": one cpu per worker");
+      for (int c : reserved)
+	expect(std::find(cpus.begin(), cpus.end(), c) == cpus.end(),
+	       when + ": reserved cpu " + std::to_string(c));
+      if (!seen[i].empty()) expect(seen[i] == cpus, when + ": worker cpus");
+    }
+    // goes through the startup path
+    if (p > 1) {
+      set_num_workers(p - 1);
+      set_num_workers(p);
+    }
+  }
+}
+
+int main (int argc, char *argv[]) {
+  commandLine P(argc, argv, "");
+  std::vector<int> main_cpus = thread_cpus();
+  cout << "num threads = " << num_workers() << ", cpus = "
+       << cpu_list(main_cpus) << endl;
+
+  // the last cpu is reserved when there is more than one
+  std::vector<int> reserved;
+  if (main_cpus.size() > 1) reserved.push_back(main_cpus.back());
+  std::vector<std::string> policies = {"compact", "scatter", cpu_list(main_cpus), "none"};
+  for (std::string policy : policies) {
+    check(policy, {}, main_cpus);
+    check(policy, reserved, main_cpus);
+  }
+
+  return check_result("affinity");
+}
@@ -15,12 +15,80 @@ template <typename T, typename Allocator=pbbs::allocator<T>>
     my_vect(size_t n, const Allocator &allocator = Allocator()) : n(n), allocator(allocator) {}
   };
 
-int main (int argc, char *argv[]) {
+// Allocates and frees pairs of large blocks (1 to 3MB, as the per
+// block scratch of a transpose or count sort) from all workers at once,
+// reporting millions of pairs per second as the number of workers
+// grows, with the per worker caches of large blocks and without.
+void large_alloc_throughput(size_t pairs) {
+  int max_p = num_workers();
+  std::vector<int> counts;
+  for (int p = 1; p < max_p; p *= 2) counts.push_back(p);
+  counts.push_back(max_p);
+  auto run = [&] () {
+    parallel_for(0, pairs, [&] (size_t i) {
+	size_t n = (1 + i % 3) << 20;
+	char* a = (char*) default_allocator.allocate(n);
+	char* b = (char*) default_allocator.allocate(n + 4096);
+	a[0] = b[0] = 1;
+	default_allocator.deallocate(a, n);
+	default_allocator.deallocate(b, n + 4096);
+      }, 1);
+  };
+  for (bool cached : {true, false}) {
+    if (!cached) default_allocator.set_thread_cache_limit(0);
+    for (int p : counts) {
+      set_num_workers(p);
+      run();
+      timer t;
+      run();
+      cout << "large blocks " << (cached ? "with" : "without")
+	   << " thread caches, " << p << " workers: "
+	   << pairs / t.get_next() / 1e6 << " Mpairs/sec" << endl;
+    }
+  }
+  set_num_workers(max_p);
+  default_allocator.trim();
+}
+
+// Allocates and frees n blocks from all workers at once with short
+// thread lists (64 blocks), so that threads keep moving lists to and
+// from the shared pool, reporting millions of blocks per second as
+// the number of workers grows.
+void block_storm(size_t n) {
+  int max_p = num_workers();
+  std::vector<int> counts;
+  for (int p = 1; p < max_p; p *= 2) counts.push_back(p);
+  counts.push_back(max_p);
+  block_allocator ba(64, 0, 64 * 64);
+  sequence<char*> b(n);
+  auto run = [&] () {
+    parallel_for(0, n, [&] (size_t i) {
+	b[i] = (char*) ba.alloc();
+	b[i][0] = 1;}, 1000);
+    parallel_for(0, n, [&] (size_t i) {ba.free(b[n-1-i]);}, 1000);
+  };
+  for (int p : counts) {
+    set_num_workers(p);
+    run();
+    timer t;
+    run();
+    cout << "block storm, " << p << " workers: "
+	 << n / t.get_next() / 1e6 << " Mblocks/sec" << endl;
+  }
+  set_num_workers(max_p);
+}
+
+int main (int, char *[]) {
   //small_allocator pool;
   size_t n = 100000000;
   int rounds = 4;
   timer t;
 
+  large_alloc_throughput(1000000);
+  cout << endl;
+  block_storm(10000000);
+  cout << endl;
+
   my_vect<double> a(10);
 
   cout << "hello: " << sizeof(a) << endl;
@@ -49,7 +117,7 @@ int main (int argc, char *argv[]) {
   {
     //mem_pool mp;
     for (int i=0; i < rounds; i++) {
-      sequence<char *> b(n, [&] (size_t i) {
+      sequence<char *> b(n, [&] (size_t) {
 	  char* foo = (char*) my_alloc(48);
 	  foo[0] = 'a';
 	  foo[1] = 0;
@@ -71,7 +139,7 @@ int main (int argc, char *argv[]) {
     pool_allocator sa(sizes);
     t.next("initialize");
     for (int i=0; i < rounds; i++) {
-      sequence<char *> b(n, [&] (size_t i) {
+      sequence<char *> b(n, [&] (size_t) {
 	  char* foo = (char*) sa.allocate(64);
 	  foo[0] = 'a';
 	  foo[1] = 0;
@@ -114,7 +182,7 @@ int main (int argc, char *argv[]) {
     la::init();
     t.next("initialize");
     for (int j=0; j < rounds; j++) {
-      sequence<char *> b(n, [&] (size_t i) {
+      sequence<char *> b(n, [&] (size_t) {
 	  char* foo = (char*) la::alloc();
 	  foo[0] = 'a';
 	  foo[1] = 0;
@@ -132,7 +200,7 @@ int main (int argc, char *argv[]) {
   cout << endl;
   
     for (int j=0; j < rounds; j++) {
-    sequence<char *> b(n, [&] (size_t i) {
+    sequence<char *> b(n, [&] (size_t) {
 	char* foo = (char*) malloc(48);
 	foo[0] = 'a';
 	foo[1] = 0;
@@ -0,0 +1,87 @@
+#include <thread>
+#include "get_time.h"
+#include "parse_command_line.h"
+#include "sequence.h"
+#include "arena_scope.h"
+#include "test_check.h"
+
+// Checks the bump allocator of arena_scope.h from workers, nested
+// scopes and threads outside the pool, and times rounds of per block
+// temporaries allocated from it against the pool allocator.
+
+template <typename Alloc>
+using seq = pbbs::sequence<long, Alloc>;
+
+// a round: allocates m temporaries of up to len elements, which live
+// until the end of the round, and sums them
+template <typename Alloc>
+long round(size_t m, size_t len) {
+  pbbs::sequence<seq<Alloc>> temps(m, [&] (size_t i) {
+      return seq<Alloc>(i % len + 2, [&] (size_t k) {return (long) (i + k);});});
+  return pbbs::reduce(pbbs::dseq(m, [&] (size_t i) {
+	return pbbs::reduce(temps[i], pbbs::addm<long>());}), pbbs::addm<long>());
+}
+
+int main (int argc, char *argv[]) {
+  commandLine P(argc, argv, "[-n <size>] [-r <rounds>]");
+  size_t n = P.getOptionLongValue("-n", 10000000);
+  int rounds = P.getOptionIntValue("-r", 20);
+  using arena = pbbs::arena_allocator<long>;
+  using pool = pbbs::allocator<long>;
+  cout << "num threads = " << num_workers() << endl;
+
+  // blocks allocated from all workers at once do not overlap
+  {
+    pbbs::arena_scope s;
+    size_t m = 10000;
+    pbbs::sequence<long*> ptrs(m, [&] (size_t i) {
+	long* p = arena().allocate(i % 100 + 1);
+	for (size_t j = 0; j < i % 100 + 1; j++) p[j] = i;
+	return p;}, 1);
+    size_t bad = pbbs::count_if_index(m, [&] (size_t i) {
+	for (size_t j = 0; j < i % 100 + 1; j++)
+	  if (ptrs[i][j] != (long) i) return true;
+	return false;});
+    expect(bad == 0, "no overlap");
+    expect(s.bytes_reserved() < m * 100 * sizeof(long)
+	   + (num_workers() + 1) * pbbs::arena_scope::default_chunk_size,
+	   "bytes reserved");
+
+    // large requests get their own chunk
+    seq<arena> big(n, [&] (size_t i) {return (long) i;});
+    expect(big[n-1] == (long) n-1, "large");
+
+    {
+      pbbs::arena_scope inner;
+      expect(pbbs::arena_scope::innermost() == &inner, "nested");
+      seq<arena> a(1000, 1l);
+      expect(inner.bytes_reserved() > 0, "nested allocates");
+    }
+    expect(pbbs::arena_scope::innermost() == &s, "nested restores");
+
+    std::vector<std::thread> threads;
+    for (int k=0; k < 4; k++)
+      threads.push_back(std::thread([&] () {
+	    long total = round<arena>(1000, 100);
+	    expect(total == round<pool>(1000, 100), "outside pool");}));
+    for (auto &th : threads) th.join();
+  }
+  bool thrown = false;
+  try {arena().allocate(10);} catch (std::bad_alloc const &) {thrown = true;}
+  expect(thrown, "outside a scope");
+
+  // many small temporaries per round
+  size_t m = n / 32, len = 62;
+  long expected = round<pool>(m, len);
+  timer t;
+  for (int r=0; r < rounds; r++)
+    expect(round<pool>(m, len) == expected, "pool round");
+  t.next("rounds with pool allocator");
+  for (int r=0; r < rounds; r++) {
+    pbbs::arena_scope s;
+    expect(round<arena>(m, len) == expected, "arena round");
+  }
+  t.next("rounds with arena_scope");
+
+  return check_result("arena scope");
+}
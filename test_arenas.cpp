@@ -0,0 +1,122 @@
+#include <set>
+#include "get_time.h"
+#include "parse_command_line.h"
+#include "sequence.h"
+#include "random.h"
+#include "sample_sort.h"
+#include "future.h"
+#include "test_check.h"
+
+// Tests worker arenas: that work run in an arena stays on the workers
+// allowed to take it, and that a lending low priority arena helps a
+// high priority one.  Also times a short query with and without a big
+// background sort running in a low priority arena.
+
+// the workers that ran some iteration of a loop of n iterations
+std::set<int> loop_workers(size_t n) {
+  std::vector<std::atomic<bool>> used(num_workers());
+  for (auto &u : used) u = false;
+  parallel_for(0, n, [&] (size_t) {
+      used[worker_id()] = true;
+      for (volatile int j=0; j < 20000; j++);}, 1);
+  std::set<int> r;
+  for (int i=0; i < num_workers(); i++) if (used[i]) r.insert(i);
+  return r;
+}
+
+bool subset(std::set<int> const &a, std::set<int> const &b) {
+  for (int x : a) if (b.count(x) == 0) return false;
+  return true;
+}
+
+std::set<int> as_set(std::vector<int> const &v) {
+  return std::set<int>(v.begin(), v.end());
+}
+
+double query(pbbs::sequence<long> const &a) {
+  timer t;
+  pbbs::sequence<long> b = pbbs::sample_sort(a, std::less<long>());
+  expect(b[0] <= b[b.size()-1], "query");
+  return t.stop();
+}
+
+int main (int argc, char *argv[]) {
+  commandLine P(argc, argv, "[-n <size>] [-q <query size>] [-r <rounds>]");
+  size_t n = P.getOptionLongValue("-n", 20000000);
+  size_t qn = P.getOptionLongValue("-q", 100000);
+  int rounds = P.getOptionIntValue("-r", 5);
+  int p = num_workers();
+  cout << "num threads = " << p << endl;
+  if (p < 4) {
+    cout << "needs at least 4 workers (set NUM_THREADS)" << endl;
+    return 0;
+  }
+
+  // keep the default arena's workers to themselves
+  fj.sched->set_arena(0, 0, false);
+
+  {
+    worker_arena q((p-1)/2, 1, false);
+    std::set<int> qw = as_set(q.workers());
+    std::set<int> dw = as_set(fj.sched->workers_of_arena(0));
+    std::set<int> q_used;
+    q.execute([&] () {q_used = loop_workers(2000);});
+    qw.insert(0); // the caller
+    expect(subset(q_used, qw), "isolated arena");
+    expect(q_used.size() > 1, "arena workers used");
+    expect(subset(loop_workers(2000), dw), "default arena");
+
+    // a low priority arena that lends its workers to the high priority one
+    {
+      worker_arena b(1, -1, true);
+      std::set<int> bw = as_set(b.workers());
+      std::set<int> helped;
+      for (int r=0; r < 10 && !subset(bw, helped); r++)
+	q.execute([&] () {
+	    for (int x : loop_workers(2000)) helped.insert(x);});
+      expect(subset(bw, helped), "lending");
+
+      // the high priority arena does not lend, so never runs its work
+      // (waits for the job to start, since until then it is in this
+      // worker's deque, and so would count as in q during q.execute)
+      std::set<int> b_used;
+      std::atomic<bool> started(false);
+      auto bg = pbbs::spawn([&] () {
+	  started = true;
+	  b.execute([&] () {b_used = loop_workers(2000);});});
+      while (!started) std::this_thread::yield();
+      q.execute([&] () {loop_workers(2000);});
+      bg.wait();
+      for (int x : b_used) expect(qw.count(x) == 0 || x == 0, "not lending");
+    }
+  }
+  fj.sched->set_arena(0, 0, true);
+
+  // a short query alone, and while a big sort runs in the background
+  pbbs::random rnd(0);
+  pbbs::sequence<long> big(n, [&] (size_t i) {return (long) rnd.ith_rand(i);});
+  pbbs::sequence<long> small(qn, [&] (size_t i) {return (long) rnd.ith_rand(n+i);});
+  {
+    worker_arena q(p/2, 1, false);
+    worker_arena b(p - p/2 - 1, -1, true);
+    std::vector<double> alone, busy;
+    for (int r=0; r < rounds; r++)
+      q.execute([&] () {alone.push_back(query(small));});
+    std::atomic<bool> done(false), started(false);
+    auto bg = pbbs::spawn([&] () {
+	started = true;
+	b.execute([&] () {
+	    while (!done) pbbs::sample_sort(big, std::less<long>());});});
+    while (!started) std::this_thread::yield();
+    for (int r=0; r < rounds; r++)
+      q.execute([&] () {busy.push_back(query(small));});
+    done = true;
+    bg.wait();
+    std::sort(alone.begin(), alone.end());
+    std::sort(busy.begin(), busy.end());
+    cout << "query median: alone " << alone[rounds/2] << ", with background "
+	 << busy[rounds/2] << endl;
+  }
+
+  return check_result("arenas");
+}
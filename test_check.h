@@ -0,0 +1,28 @@
+#pragma once
+
+#include <atomic>
+#include <iostream>
+#include <string>
+
+// Checks shared by the test programs.  A failed check prints its name
+// and is counted, and can be made from any thread.
+
+std::atomic<long> failures(0);
+
+void expect(bool b, std::string const &name) {
+  if (!b) {
+    std::cout << name << ": failed" << std::endl;
+    failures++;
+  }
+}
+
+// Prints the number of failures, or that the named test is ok, and
+// returns the exit status for main.
+int check_result(std::string const &name) {
+  if (failures > 0) {
+    std::cout << failures << " failures" << std::endl;
+    return 1;
+  }
+  std::cout << name << " ok" << std::endl;
+  return 0;
+}
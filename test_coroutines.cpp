@@ -0,0 +1,104 @@
+#include <stdexcept>
+#include "get_time.h"
+#include "parse_command_line.h"
+#include "sequence.h"
+#include "random.h"
+#include "coroutine.h"
+#include "test_check.h"
+
+// Tests coroutine tasks (coroutine.h), and times many concurrent
+// "requests" each of which is a coroutine that fans out into library
+// functions, against running the same requests one after the other.
+
+pbbs::task<long> fib(long n) {
+  if (n < 2) co_return n;
+  auto [l, r] = co_await pbbs::par(fib(n-1), fib(n-2));
+  co_return l + r;
+}
+
+pbbs::task<long> sum(pbbs::sequence<long> const &a, size_t s, size_t e) {
+  if (e - s < 10000) {
+    long r = 0;
+    for (size_t i=s; i < e; i++) r += a[i];
+    co_return r;
+  }
+  auto [l, r] = co_await pbbs::par(sum(a, s, (s+e)/2), sum(a, (s+e)/2, e));
+  co_return l + r;
+}
+
+pbbs::task<> touch(std::atomic<long> &count) {
+  count++;
+  co_return;
+}
+
+pbbs::task<long> thrower(long i) {
+  if (i == 3) throw std::runtime_error("thrower");
+  co_return i;
+}
+
+// A request: generate some keys, sort them, and check the result,
+// with an asynchronous wait in the middle.
+pbbs::task<bool> request(size_t n, size_t seed) {
+  auto keys = pbbs::spawn([=] () {
+      pbbs::random r(seed);
+      return pbbs::sequence<long>(n, [&] (size_t i) {return (long) (r.ith_rand(i) % n);});});
+  pbbs::sequence<long> a = co_await keys;
+  auto sorted = pbbs::sort(a, std::less<long>());
+  size_t bad = pbbs::find_if_index(n-1, [&] (size_t i) {
+      return sorted[i+1] < sorted[i];});
+  co_return bad == n-1;
+}
+
+int main (int argc, char *argv[]) {
+  commandLine P(argc, argv, "[-n <size>] [-q <requests>] [-r <rounds>]");
+  size_t n = P.getOptionLongValue("-n", 1000000);
+  size_t q = P.getOptionLongValue("-q", 100);
+  int rounds = P.getOptionIntValue("-r", 3);
+
+  pbbs::sequence<long> a(n, [] (size_t i) {return (long) i;});
+  for (int r=0; r < rounds; r++) {
+    expect(pbbs::sync_wait(fib(20)) == 6765, "fib");
+    expect(pbbs::sync_wait(sum(a, 0, n)) == (long) (n*(n-1)/2), "sum");
+
+    std::atomic<long> count(0);
+    pbbs::sync_wait([&] () -> pbbs::task<> {
+	co_await pbbs::par(touch(count), touch(count));
+	co_await pbbs::schedule();
+	co_await touch(count);}());
+    expect(count == 3, "void tasks");
+
+    bool caught = false;
+    try { pbbs::sync_wait(thrower(3)); }
+    catch (std::runtime_error const &) {caught = true;}
+    expect(caught, "exception");
+
+    caught = false;
+    try {
+      pbbs::sync_wait([] () -> pbbs::task<long> {
+	  auto [x, y] = co_await pbbs::par(thrower(1), thrower(3));
+	  co_return x + y;}());
+    } catch (std::runtime_error const &) {caught = true;}
+    expect(caught, "exception in par");
+
+    // coroutines used inside ordinary fork-join code
+    std::atomic<long> total(0);
+    parallel_for(0, 100, [&] (size_t i) {total += pbbs::sync_wait(fib(i % 10));});
+    expect(total == 880, "sync_wait in parallel_for");
+  }
+
+  timer t;
+  for (int r=0; r < rounds; r++) {
+    std::vector<pbbs::future<bool>> rs;
+    for (size_t i=0; i < q; i++)
+      rs.push_back(pbbs::start(request(n/q, i)));
+    for (auto &f : rs) expect(f.get(), "request");
+  }
+  t.next("concurrent requests");
+
+  for (int r=0; r < rounds; r++)
+    for (size_t i=0; i < q; i++)
+      expect(pbbs::sync_wait(request(n/q, i)), "request");
+  t.next("sequential requests");
+
+  return check_result("coroutines");
+}
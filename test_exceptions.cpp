@@ -0,0 +1,76 @@
+#include <stdexcept>
+#include "get_time.h"
+#include "parse_command_line.h"
+#include "sequence.h"
+#include "sample_sort.h"
+#include "test_check.h"
+
+// Checks that exceptions thrown inside parallel code are rethrown at
+// the par_do or parallel_for that forked them, and that the scheduler
+// keeps working afterwards.
+
+struct test_error : std::runtime_error {
+  test_error(long i) : std::runtime_error(std::to_string(i)) {}
+};
+
+template <typename F>
+void expect_throw(std::string name, F f) {
+  try {
+    f();
+    cout << name << ": no exception" << endl;
+    failures++;
+  } catch (test_error const &e) {
+    cout << name << ": caught " << e.what() << endl;
+  }
+}
+
+// throws at depth 0 from the right branch, after giving time for it
+// to be stolen
+long throw_deep(long depth) {
+  if (depth == 0) throw test_error(0);
+  long l = 0, r = 0;
+  par_do([&] () { l = throw_deep(depth-1);},
+	 [&] () { for (volatile int j=0; j < 10000; j++); r = 1;});
+  return l + r;
+}
+
+int main (int argc, char *argv[]) {
+  commandLine P(argc, argv, "[-n <size>] [-r <rounds>]");
+  size_t n = P.getOptionLongValue("-n", 1000000);
+  int rounds = P.getOptionIntValue("-r", 10);
+
+  for (int r=0; r < rounds; r++) {
+    expect_throw("par_do left", [&] () {
+	par_do([&] () {throw test_error(1);}, [&] () {});});
+
+    expect_throw("par_do right", [&] () {
+	par_do([&] () {for (volatile int j=0; j < 100000; j++);},
+	       [&] () {throw test_error(2);});});
+
+    expect_throw("nested par_do", [&] () {throw_deep(100);});
+
+    size_t k = (r * 7919) % n;
+    expect_throw("parallel_for", [&] () {
+	parallel_for(0, n, [&] (size_t i) {
+	    if (i == k) throw test_error(i);});});
+
+    expect_throw("parallel_for blocked", [&] () {
+	parallel_for(0, n, [&] (size_t i) {
+	    if (i == k) throw test_error(i);}, 100);});
+
+    pbbs::sequence<long> a(n, [&] (size_t i) {return (i * 7919) % n;});
+    expect_throw("sample_sort", [&] () {
+	pbbs::sample_sort(a, [&] (long x, long y) {
+	    if (x == (long) k) throw test_error(k);
+	    return x < y;});});
+  }
+
+  // make sure still works
+  pbbs::sequence<long> a(n, [&] (size_t i) {return n - i;});
+  pbbs::sequence<long> b = pbbs::sample_sort(a, std::less<long>());
+  bool sorted = true;
+  for (size_t i=0; i < n; i++) sorted = sorted && b[i] == (long) i + 1;
+  expect(sorted, "sort after exceptions");
+
+  return check_result("exceptions");
+}
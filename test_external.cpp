@@ -0,0 +1,70 @@
+#include <stdexcept>
+#include <thread>
+#include "get_time.h"
+#include "parse_command_line.h"
+#include "sequence.h"
+#include "random.h"
+#include "sample_sort.h"
+#include "future.h"
+#include "test_check.h"
+
+// Calls the library from many threads outside the scheduler pool at
+// once, as the request threads of a server would, and checks every
+// result.  Also times the same requests from one thread.
+
+// a request: sort some random keys, and sum them
+void request(size_t n, size_t seed) {
+  pbbs::random r(seed);
+  pbbs::sequence<long> a(n, [&] (size_t i) {return (long) (r.ith_rand(i) % n);});
+  auto sorted = pbbs::sample_sort(a, std::less<long>());
+  size_t bad = pbbs::find_if_index(n-1, [&] (size_t i) {
+      return sorted[i+1] < sorted[i];});
+  expect(bad == n-1, "sort");
+  long total = pbbs::reduce(sorted, pbbs::addm<long>());
+  long expected = 0;
+  for (size_t i=0; i < n; i++) expected += a[i];
+  expect(total == expected, "reduce");
+}
+
+// exceptions, par_do and futures from a thread outside the pool
+void others(size_t i) {
+  bool caught = false;
+  try {
+    parallel_for(0, 1000, [&] (size_t j) {
+	if (j == i % 1000) throw std::runtime_error("external");});
+  } catch (std::runtime_error const &) {caught = true;}
+  expect(caught, "exception");
+  long l = 0, r = 0;
+  par_do([&] () {l = i;}, [&] () {r = i+1;});
+  expect(l + r == (long) (2*i+1), "par_do");
+  auto f = pbbs::spawn([=] () {return (long) i;});
+  expect(f.get() == (long) i, "future");
+}
+
+int main (int argc, char *argv[]) {
+  commandLine P(argc, argv, "[-n <size>] [-t <threads>] [-q <requests per thread>]");
+  size_t n = P.getOptionLongValue("-n", 100000);
+  int t = P.getOptionIntValue("-t", 16);
+  int q = P.getOptionIntValue("-q", 20);
+  cout << "num threads = " << num_workers() << endl;
+  expect(worker_id() == 0, "main is worker 0");
+
+  timer tm;
+  std::vector<std::thread> threads;
+  for (int k=0; k < t; k++)
+    threads.push_back(std::thread([=] () {
+	  expect(worker_id() == -1, "outside pool");
+	  for (int j=0; j < q; j++) {
+	    request(n, k*q + j);
+	    others(k*q + j);
+	  }}));
+  for (auto &th : threads) th.join();
+  tm.next("from " + std::to_string(t) + " threads");
+
+  for (int k=0; k < t; k++)
+    for (int j=0; j < q; j++)
+      request(n, k*q + j);
+  tm.next("from the main thread");
+
+  return check_result("external");
+}
@@ -0,0 +1,86 @@
+#include <stdexcept>
+#include "get_time.h"
+#include "parse_command_line.h"
+#include "sequence.h"
+#include "future.h"
+#include "test_check.h"
+
+// Tests futures and task graphs (future.h), including mixing them with
+// par_do and parallel_for, and times a pipeline where each stage of a
+// chunk starts as soon as the previous stage of that chunk is done.
+
+long fib(long n) {
+  if (n < 2) return n;
+  auto l = pbbs::spawn([=] () {return fib(n-1);});
+  long r = fib(n-2);
+  return l.get() + r;
+}
+
+// sum of a stage that does par_do's inside a spawned function
+long nested_sum(long n) {
+  auto f = pbbs::spawn([=] () {
+      pbbs::sequence<long> a(n, [] (size_t i) {return (long) i;});
+      return pbbs::reduce(a, pbbs::addm<long>());});
+  return f.get();
+}
+
+int main (int argc, char *argv[]) {
+  commandLine P(argc, argv, "[-n <size>] [-c <chunks>] [-r <rounds>]");
+  size_t n = P.getOptionLongValue("-n", 10000000);
+  size_t chunks = P.getOptionLongValue("-c", 20);
+  int rounds = P.getOptionIntValue("-r", 3);
+
+  for (int r=0; r < rounds; r++) {
+    expect(fib(20) == 6765, "fib");
+    expect(nested_sum(n) == (long) (n*(n-1)/2), "nested");
+
+    // spawns inside the left branch of par_do and a parallel_for
+    std::atomic<long> count(0);
+    par_do([&] () {
+	std::vector<pbbs::future<void>> fs;
+	for (int i=0; i < 100; i++)
+	  fs.push_back(pbbs::spawn([&] () {count++;}));
+	pbbs::wait_all(fs);},
+      [&] () {count++;});
+    parallel_for(0, 100, [&] (size_t) {pbbs::spawn([&] () {count++;}).wait();});
+    expect(count == 201, "spawn in par_do");
+
+    // a diamond: a -> (b, c) -> d
+    auto a = pbbs::spawn([] () {return 1L;});
+    auto b = pbbs::continue_when_all([=] () {return a.get() + 1;}, a);
+    auto c = pbbs::continue_when_all([=] () {return a.get() + 2;}, a);
+    auto d = pbbs::continue_when_all([=] () {return b.get() * c.get();}, b, c);
+    expect(d.get() == 6, "diamond");
+
+    // exceptions go to whoever gets the result, through continuations
+    auto e = pbbs::spawn([] () -> long {throw std::runtime_error("e");});
+    auto g = pbbs::continue_when_all([=] () {return e.get() + 1;}, e);
+    bool caught = false;
+    try {g.get();} catch (std::runtime_error const &) {caught = true;}
+    expect(caught, "exception");
+  }
+
+  // A pipeline of two stages on each chunk: generate and then sum.
+  // The sum of a chunk starts when its generate is done, rather than
+  // when all of them are, and the results are combined as they arrive.
+  size_t m = n / chunks;
+  timer t;
+  for (int r=0; r < rounds; r++) {
+    std::vector<pbbs::future<long>> sums;
+    for (size_t i=0; i < chunks; i++) {
+      auto gen = pbbs::spawn([=] () {
+	  return pbbs::sequence<long>(m, [&] (size_t j) {return (long) (i*m + j);});});
+      sums.push_back(pbbs::continue_when_all([=] () {
+	    return pbbs::reduce(gen.get(), pbbs::addm<long>());}, gen));
+    }
+    auto total = pbbs::continue_when_all([=] () {
+	long s = 0;
+	for (auto &f : sums) s += f.get();
+	return s;}, sums);
+    long k = m * chunks;
+    expect(total.get() == (long) (k*(k-1)/2), "pipeline");
+  }
+  t.next("pipeline");
+
+  return check_result("futures");
+}
@@ -0,0 +1,77 @@
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <vector>
+#include <algorithm>
+#include "get_time.h"
+#include "parse_command_line.h"
+#include "utilities.h"
+
+// Measures the behavior of the scheduler between parallel phases:
+//   idle cpu : cores used by the process while the main thread sleeps
+//   wake latency : time from a fork after an idle period until the
+//     forked branch starts running on another worker
+
+using clk = std::chrono::steady_clock;
+
+double cpu_seconds() {
+  struct rusage r;
+  getrusage(RUSAGE_SELF, &r);
+  return (r.ru_utime.tv_sec + r.ru_stime.tv_sec) +
+    (r.ru_utime.tv_usec + r.ru_stime.tv_usec) / 1e6;
+}
+
+void sleep_ms(long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+int main (int argc, char *argv[]) {
+  commandLine P(argc, argv, "[-i <idle ms>] [-g <gap ms>] [-r <rounds>]");
+  long idle_ms = P.getOptionLongValue("-i", 1000);
+  long gap_ms = P.getOptionLongValue("-g", 20);
+  int rounds = P.getOptionIntValue("-r", 50);
+  size_t n = 10000000;
+
+  cout << "num threads = " << num_workers() << endl;
+
+  // get all the workers going, then let them go idle
+  long* a = new long[n];
+  parallel_for(0, n, [&] (size_t i) {a[i] = i;});
+
+  auto wall_start = clk::now();
+  double cpu_start = cpu_seconds();
+  sleep_ms(idle_ms);
+  double cpu = cpu_seconds() - cpu_start;
+  double wall = std::chrono::duration<double>(clk::now() - wall_start).count();
+  cout << "idle cpu : " << cpu/wall << " cores" << endl;
+
+  if (num_workers() < 2) {
+    cout << "wake latency : needs at least 2 workers" << endl;
+    delete[] a;
+    return 0;
+  }
+
+  std::vector<double> lat;
+  for (int r=0; r < rounds; r++) {
+    sleep_ms(gap_ms);
+    std::atomic<bool> started(false);
+    clk::time_point t_start;
+    auto t_fork = clk::now();
+    par_do([&] () {
+	// wait for someone to steal the right branch, giving up after a second
+	while (!started.load() && clk::now() - t_fork < std::chrono::seconds(1));
+      },
+      [&] () {
+	if (!started.load()) {
+	  t_start = clk::now();
+	  started.store(true);
+	}
+      });
+    lat.push_back(std::chrono::duration<double, std::micro>(t_start - t_fork).count());
+  }
+  std::sort(lat.begin(), lat.end());
+  cout << "wake latency : median = " << lat[lat.size()/2]
+       << " usec, max = " << lat[lat.size()-1] << " usec" << endl;
+
+  delete[] a;
+  return 0;
+}
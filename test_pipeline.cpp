@@ -0,0 +1,105 @@
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdexcept>
+#include "get_time.h"
+#include "parse_command_line.h"
+#include "sequence.h"
+#include "random.h"
+#include "collect_reduce.h"
+#include "strings/string_basics.h"
+#include "pipeline.h"
+
+// Counts words by hash bucket in a generated text, in the style of
+// examples/build_index.cpp, both with the whole text materialized at
+// once and with a pipeline over chunks of it, and checks they agree.
+// Reports the time and the growth in peak memory of each (the pipeline
+// is run first since peak memory never goes down).
+
+size_t num_buckets = 1 << 16;
+
+long max_rss_mb() {
+  struct rusage r;
+  getrusage(RUSAGE_SELF, &r);
+  return r.ru_maxrss / 1024;
+}
+
+// Text with words of 1 to 8 letters separated by single spaces.
+// Chunks start and end at word boundaries since every word is within a
+// block of 16 characters.
+pbbs::sequence<char> text(size_t start, size_t end) {
+  pbbs::random r(0);
+  return pbbs::sequence<char>(end - start, [&] (size_t j) {
+      size_t i = start + j;
+      size_t len = 1 + r.ith_rand(i/16) % 8;
+      if (i % 16 >= len) return ' ';
+      return (char) ('a' + r.ith_rand(i) % 4);});
+}
+
+// the count of words in each hash bucket
+pbbs::sequence<size_t> count_words(pbbs::sequence<char> &str) {
+  size_t n = str.size();
+  pbbs::sequence<char> s(n + 1, [&] (size_t i) {return i < n ? str[i] : 0;});
+  auto r = s.slice(0, n);
+  auto words = pbbs::tokenize(r, [] (char c) {return c == ' ';});
+  auto keys = pbbs::sequence<size_t>(words.size(), [&] (size_t i) {
+      size_t h = 0;
+      for (char* p = words[i]; *p != 0; p++) h = h * 31 + *p;
+      return pbbs::hash64(h) % num_buckets;});
+  return pbbs::histogram(keys, num_buckets);
+}
+
+int main (int argc, char *argv[]) {
+  commandLine P(argc, argv, "[-n <size>] [-c <chunk size>] [-d <depth>]");
+  size_t n = P.getOptionLongValue("-n", 100000000);
+  size_t chunk = P.getOptionLongValue("-c", 1 << 22) / 16 * 16;
+  size_t depth = P.getOptionLongValue("-d", 2 * num_workers());
+  cout << "num threads = " << num_workers() << endl;
+
+  long base = max_rss_mb();
+  timer t;
+  pbbs::sequence<size_t> pipe_counts(num_buckets, (size_t) 0);
+  size_t next = 0;
+  pbbs::pipeline<pbbs::sequence<char>>(depth,
+    [&] (pbbs::sequence<char> &c) {
+      if (next >= n) return false;
+      c = text(next, std::min(n, next + chunk));
+      next += chunk;
+      return true;},
+    [&] (pbbs::sequence<char> &&c) {return count_words(c);},
+    [&] (pbbs::sequence<size_t> const &counts) {
+      parallel_for(0, num_buckets, [&] (size_t i) {pipe_counts[i] += counts[i];});});
+  t.next("pipeline");
+  long pipe_mb = max_rss_mb() - base;
+
+  base = max_rss_mb();
+  t.start();
+  pbbs::sequence<char> all = text(0, n);
+  auto counts = count_words(all);
+  t.next("all at once");
+  long all_mb = max_rss_mb() - base;
+
+  cout << "peak memory: pipeline " << pipe_mb << " MB, all at once "
+       << all_mb << " MB" << endl;
+
+  bool ok = true;
+  for (size_t i=0; i < num_buckets; i++)
+    if (counts[i] != pipe_counts[i]) ok = false;
+
+  // exceptions stop the pipeline and are passed on
+  bool caught = false;
+  size_t reads = 0;
+  try {
+    pbbs::pipeline<int>(4,
+      [&] (int &c) {c = reads++; return reads < 1000;},
+      [&] (int &&c) {if (c == 10) throw std::runtime_error("ten"); return c;},
+      [&] (int const &c) {if (c >= 10) ok = false;});
+  } catch (std::runtime_error const &) {caught = true;}
+  if (!caught || reads > 20) ok = false;
+
+  if (!ok) {
+    cout << "pipeline test failed" << endl;
+    return 1;
+  }
+  cout << "pipeline ok" << endl;
+  return 0;
+}
@@ -0,0 +1,59 @@
+#include <vector>
+#include <algorithm>
+#include "get_time.h"
+#include "parse_command_line.h"
+#include "utilities.h"
+
+// Alternates the number of workers between parallel loops, checking
+// that only the requested workers participate and that throughput
+// tracks the number of workers (as long as there are that many cores).
+
+int main (int argc, char *argv[]) {
+  commandLine P(argc, argv, "[-n <size>] [-r <rounds>]");
+  size_t n = P.getOptionLongValue("-n", 1000000);
+  int rounds = P.getOptionIntValue("-r", 5);
+  int max_p = num_workers();
+  int cores = std::thread::hardware_concurrency();
+
+  std::vector<int> counts = {max_p, 1, std::max(1, max_p/2), max_p, 1, max_p};
+  std::vector<std::atomic<bool>> used(max_p);
+  double base = 0.0;
+  bool ok = true;
+
+  auto spin = [&] (size_t) {
+    used[worker_id()] = true;
+    for (volatile int j=0; j < 200; j++);
+  };
+
+  for (int p : counts) {
+    set_num_workers(p);
+    for (auto &u : used) u = false;
+    parallel_for(0, n, spin);
+    timer t;
+    for (int r=0; r < rounds; r++) parallel_for(0, n, spin);
+    double throughput = (n * rounds) / t.get_next() / 1e6;
+    if (p == 1) base = throughput;
+
+    int num_used = 0;
+    for (int i=0; i < max_p; i++)
+      if (used[i]) {
+	num_used++;
+	if (i >= p) ok = false;
+      }
+    cout << "workers = " << num_workers() << ", used = " << num_used
+	 << ", throughput = " << throughput << " M/sec";
+    if (base > 0.0) cout << ", speedup = " << throughput / base;
+    cout << endl;
+    if (num_workers() != p) ok = false;
+    // only expect a speedup when there are the cores for it
+    if (base > 0.0 && p <= cores && throughput < .5 * p * base) {
+      cout << "  throughput does not track number of workers" << endl;
+      ok = false;
+    }
+  }
+  if (!ok) {
+    cout << "resize test failed" << endl;
+    return 1;
+  }
+  return 0;
+}
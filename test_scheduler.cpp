@@ -11,12 +11,46 @@ long fib(long i) {
   return l + r;
 }
 
+// Forks all the way down to measure the cost of a fork.
+long fib_fork(long i) {
+  if (i <= 1) return 1;
+  long l,r;
+  par_do([&] () { l = fib_fork(i-1);},
+	 [&] () { r = fib_fork(i-2);});
+  return l + r;
+}
+
+// number of forks made by fib_fork(i)
+long num_forks(long i) {
+  long a = 0, b = 0; // forks for i-2 and i-1
+  for (long j = 2; j <= i; j++) {
+    long c = a + b + 1;
+    a = b; b = c;
+  }
+  return (i <= 1) ? 0 : b;
+}
+
 int main (int argc, char *argv[]) {
-  commandLine P(argc, argv, "[-n <size>] [-p <threads>]");
+  commandLine P(argc, argv, "[-n <size>] [-f <size>] [-p <threads>]");
   size_t n = P.getOptionLongValue("-n", 45);
+  size_t f = P.getOptionLongValue("-f", 30);
   size_t m = P.getOptionLongValue("-m", 100000000);
   size_t p = P.getOptionLongValue("-p", 0);
 
+  auto job0 = [&] () {
+    timer t;
+    long r = fib_fork(f);
+    double tm = t.get_next();
+    cout << "fork overhead: " << (tm * 1e9) / num_forks(f)
+	 << " ns per fork (result " << r << ")" << endl;
+  };
+
+#if defined(OPENMP)
+#pragma omp parallel
+#pragma omp single
+#endif
+  parallel_run(job0,p);
+
   auto job = [&] () {
     timer t;
     long r = fib(n);
@@ -42,7 +76,7 @@ int main (int argc, char *argv[]) {
   };
   parallel_run(job2,p);
 
-  auto spin = [&] (int i) {
+  auto spin = [&] (int) {
     for (volatile int j=0; j < 1000; j++);
   };
 
@@ -55,6 +89,18 @@ int main (int argc, char *argv[]) {
     t2.next("map spin");
   };
   parallel_run(job3,p);
+
+  // many short loops, where the cost of deciding how to split matters
+  auto job4 = [&] () {
+    long* a = new long[1000];
+    timer t2;
+    for (int i=0; i < 100000; i++) {
+      parallel_for(0,1000,[&] (int i) {a[i] = i;});
+    }
+    t2.next("short loops");
+    delete[] a;
+  };
+  parallel_run(job4,p);
 }
   
   
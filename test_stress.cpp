@@ -0,0 +1,62 @@
+#include "get_time.h"
+#include "parse_command_line.h"
+#include "utilities.h"
+
+// Stress tests for the scheduler with very deep nesting of par_do.
+// Each of these leaves thousands of jobs on a single worker's deque.
+
+// A chain: the left branch recurses and the right is a leaf, so
+// every level leaves one job on the deque until the bottom is reached.
+long chain(long depth) {
+  if (depth == 0) return 0;
+  long l,r;
+  par_do([&] () { l = chain(depth-1);},
+	 [&] () { r = 1;});
+  return l + r;
+}
+
+// A skewed divide and conquer (e.g. quicksort with bad pivots)
+// that cuts off 1/skew of the range at each level, giving depth
+// about skew * ln(n).
+long skewed_sum(long start, long end, long skew) {
+  if (end - start < 64) {
+    long sum = 0;
+    for (long i=start; i < end; i++) sum += i;
+    return sum;
+  }
+  long mid = end - (end-start)/skew;
+  long l,r;
+  par_do([&] () { l = skewed_sum(start, mid, skew);},
+	 [&] () { r = skewed_sum(mid, end, skew);});
+  return l + r;
+}
+
+int main (int argc, char *argv[]) {
+  commandLine P(argc, argv, "[-d <depth>] [-n <size>] [-s <skew>] [-r <rounds>]");
+  long d = P.getOptionLongValue("-d", 20000);
+  long n = P.getOptionLongValue("-n", 10000000);
+  long s = P.getOptionLongValue("-s", 64);
+  int rounds = P.getOptionIntValue("-r", 5);
+
+  bool ok = true;
+  timer t;
+  for (int i=0; i < rounds; i++) {
+    long r = chain(d);
+    if (r != d) ok = false;
+  }
+  t.next("chain");
+
+  for (int i=0; i < rounds; i++) {
+    long r = skewed_sum(0, n, s);
+    if (r != n*(n-1)/2) ok = false;
+  }
+  t.next("skewed sum");
+
+  if (!ok) {
+    cout << "stress test failed" << endl;
+    return 1;
+  }
+  cout << "depth: " << d << ", approx skewed depth: "
+       << (long) (s * log((double) n)) << endl;
+  return 0;
+}
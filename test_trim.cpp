@@ -0,0 +1,101 @@
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include "get_time.h"
+#include "parse_command_line.h"
+#include "sequence.h"
+#include "test_check.h"
+
+// Checks that the pool allocator gives memory back to the system:
+// on demand with allocator_trim, when over the cache limit, and when
+// pools go unused for longer than the decay.  Reports the resident
+// memory at each step.  Also checks the counters from stats().
+
+long rss_mb() {
+  std::ifstream in("/proc/self/statm");
+  long pages = 0, resident = 0;
+  in >> pages >> resident;
+  return resident * (sysconf(_SC_PAGESIZE) / 1024) / 1024;
+}
+
+// allocates, touches and frees count sequences of the given size each
+void batch(size_t count, size_t bytes) {
+  std::vector<pbbs::sequence<char>> a;
+  for (size_t i=0; i < count; i++)
+    a.push_back(pbbs::sequence<char>(bytes, (char) 1));
+}
+
+int main (int argc, char *argv[]) {
+  commandLine P(argc, argv, "[-m <MB per batch>]");
+  size_t mb = P.getOptionLongValue("-m", 1024);
+  auto &pool = pbbs::default_allocator;
+  pool.set_decay(0);
+
+  long base = rss_mb();
+  batch(mb/32, 32 << 20);
+  long cached = rss_mb();
+  pbbs::allocator_trim();
+  long trimmed = rss_mb();
+  cout << "large blocks: before " << base << " MB, freed " << cached
+       << " MB, trimmed " << trimmed << " MB" << endl;
+  expect(cached - base > (long) mb / 2, "large blocks cached");
+  expect(trimmed - base < (long) mb / 8, "large blocks trimmed");
+  expect(pool.cached_bytes() == 0, "no cached bytes");
+
+  // blocks of 64KB are in the small pools
+  batch(mb/16*256, 64 << 10);
+  cached = rss_mb();
+  pbbs::allocator_trim();
+  trimmed = rss_mb();
+  cout << "small blocks: freed " << cached << " MB, trimmed " << trimmed
+       << " MB" << endl;
+  expect(cached - trimmed > (long) mb / 32, "small blocks trimmed");
+
+  pool.set_cache_limit(64 << 20);
+  batch(mb/32, 32 << 20);
+  cout << "with a 64 MB limit: cached " << (pool.cached_bytes() >> 20)
+       << " MB, resident " << rss_mb() << " MB" << endl;
+  expect(pool.cached_bytes() <= (64 << 20), "cache limit");
+  pool.set_cache_limit(SIZE_MAX);
+
+  // the 32MB pool goes unused, and is emptied by the 2MB blocks freed
+  // next, each releasing at most 16MB of it
+  pool.set_decay(0.1);
+  batch(mb/32, 32 << 20);
+  expect(pool.cached_bytes() >= (mb/32) * (32 << 20), "cached before decay");
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  batch(1, 2 << 20);
+  expect(pool.cached_bytes() >= (mb/32 - 1) * (32 << 20), "decay a step at a time");
+  for (size_t i=0; i < mb/32; i++) batch(1, 2 << 20);
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  batch(1, 2 << 20);
+  cout << "after decay: cached " << (pool.cached_bytes() >> 20)
+       << " MB, resident " << rss_mb() << " MB" << endl;
+  expect(pool.cached_bytes() <= (2 << 20), "decay");
+
+  // in use, cached and peak bytes, for small, large and direct blocks
+  pool.reset_peak();
+  size_t in_use = pool.stats().in_use();
+  {
+    std::vector<pbbs::sequence<char>> a;
+    for (size_t bytes : {1000, 3 << 20, 2000 << 20})
+      a.push_back(pbbs::sequence<char>(bytes, (char) 1));
+    pbbs::allocator_stats s = pool.stats();
+    expect(s.in_use() >= in_use + (2003 << 20), "in use");
+    expect(s.direct_in_use == (2000ul << 20), "direct");
+    expect(s.mapped >= s.in_use(), "mapped");
+    expect(s.thread_cached.size() == (size_t) max_workers() + 1, "thread caches");
+  }
+  pbbs::allocator_stats s = pool.stats();
+  expect(s.in_use() < in_use + (1 << 20), "freed");
+  expect(s.peak() >= in_use + (2003 << 20), "peak");
+  pool.reset_peak();
+  s = pool.stats();
+  expect(s.peak() < s.in_use() + s.held() + (8 << 20), "reset peak");
+  cout << "peak rss " << (pbbs::peak_rss() >> 20) << " MB";
+  if (pbbs::reset_peak_rss())
+    cout << ", after reset " << (pbbs::peak_rss() >> 20) << " MB";
+  cout << endl;
+
+  return check_result("trim");
+}
@@ -68,6 +68,15 @@ double t_reduce_add(size_t n, bool) {
   return t;
 }
 
+// as t_reduce_add, with the input interleaved across numa nodes
+template<typename T>
+double t_reduce_add_interleaved(size_t n, bool) {
+  pbbs::sequence<T> S(n, [] (size_t) {return (T) 1;},
+		      pbbs::memory_placement::interleave());
+  time(t, pbbs::reduce(S, pbbs::addm<T>()));
+  return t;
+}
+
 double t_map_reduce_128(size_t n, bool) {
   int stride = 16;
   pbbs::sequence<size_t> S(n*stride, (size_t) 1);
@@ -545,6 +554,66 @@ double t_find_mid(size_t n, bool check) {
   return t;
 }
 
+template<typename T>
+double t_transpose(size_t n, bool check) {
+  size_t rows = 1 << (pbbs::log2_up(n)/2);
+  size_t cols = n / rows;
+  pbbs::sequence<T> In(rows*cols, [&] (size_t i) {return i;});
+  pbbs::sequence<T> Out(rows*cols);
+  time(t, pbbs::transpose<T>(In.begin(), Out.begin()).trans(rows, cols););
+  if (check) {
+    size_t err = pbbs::find_if_index(rows*cols, [&] (size_t i) {
+	return Out[(i%cols)*rows + i/cols] != In[i];});
+    if (err < rows*cols) cout << "error in transpose at " << err << endl;
+  }
+  return t;
+}
+
+// 7 point stencil on a cube, in tiles
+double t_stencil_3d(size_t n, bool check) {
+  long s = std::max<long>(3, (long) std::cbrt((double) n));
+  auto idx = [&] (long x, long y, long z) {return (x*s + y)*s + z;};
+  pbbs::sequence<double> In(s*s*s, [&] (size_t i) {return (double) (i % 17);});
+  pbbs::sequence<double> Out(s*s*s, [&] (size_t) {return 0.0;});
+  auto point = [&] (long x, long y, long z) {
+    return (In[idx(x-1,y,z)] + In[idx(x+1,y,z)] + In[idx(x,y-1,z)] +
+	    In[idx(x,y+1,z)] + In[idx(x,y,z-1)] + In[idx(x,y,z+1)] -
+	    6 * In[idx(x,y,z)]);};
+  time(t, parallel_for_3d(1, s-1, 1, s-1, 1, s-1,
+			  [&] (long x0, long x1, long y0, long y1, long z0, long z1) {
+	  for (long x=x0; x < x1; x++)
+	    for (long y=y0; y < y1; y++)
+	      for (long z=z0; z < z1; z++)
+		Out[idx(x,y,z)] = point(x,y,z);}););
+  if (check) {
+    for (long x=0; x < s; x++)
+      for (long y=0; y < s; y++)
+	for (long z=0; z < s; z++) {
+	  bool inside = (x > 0 && y > 0 && z > 0 && x < s-1 && y < s-1 && z < s-1);
+	  if (Out[idx(x,y,z)] != (inside ? point(x,y,z) : 0.0)) {
+	    cout << "error in 3d stencil" << endl;
+	    return t;
+	  }
+	}
+  }
+  return t;
+}
+
+// the match is near the start, as is typical for lookups
+template<typename T>
+double t_find_early(size_t n, bool check) {
+  pbbs::sequence<T> In(n, [&] (size_t) {return 0;});
+  In[n/50] = 1;
+  In[n/2] = 1;
+  size_t idx;
+  bool any;
+  time(t, idx = pbbs::find(In, 1); any = pbbs::any_of(In, [] (T x) {return x == 1;}););
+  if (check)
+    if (idx != n/50 || !any)
+      cout << "error in find early " << endl;
+  return t;
+}
+
 template<typename T>
 double t_lexicograhic_compare(size_t n, bool check) {
   pbbs::sequence<T> In1(n, [&] (size_t) {return 0;});
@@ -48,10 +48,54 @@ double minf(double a, double b) {return (a < b) ? a : b;};
 double maxf(double a, double b) {return (a > b) ? a : b;};
 
 bool global_check = false;
+bool global_steals = false;
+bool global_sched_stats = false;
+bool global_mem_stats = false;
+
+// reports where steals came from, to show effect of numa aware stealing,
+// and optionally the rest of the scheduler counters
+void report_steals() {
+#if defined(HOMEGROWN)
+  if (global_steals) {
+    std::vector<size_t> s = fj.sched->steal_counts();
+    cout << "  steals: l3=" << s[0] << ", node=" << s[1]
+	 << ", machine=" << s[2] << endl;
+  }
+  if (global_sched_stats) {
+    scheduler_stats::worker w = fj.sched->stats().total();
+    cout << "  scheduler: spawned=" << w.jobs_spawned
+	 << ", run=" << w.jobs_run
+	 << ", failed steals=" << w.failed_steals
+	 << ", max depth=" << w.max_depth
+	 << ", idle=" << w.idle_time << "s" << endl;
+  }
+  fj.sched->reset_stats();
+#endif
+}
+
+// starts the memory high water marks, returning where the allocator's
+// peak starts (the bytes in use, and cached by threads, since the peak
+// counts both)
+size_t start_memory() {
+  if (!global_mem_stats) return 0;
+  pbbs::default_allocator.reset_peak();
+  pbbs::reset_peak_rss();
+  return pbbs::default_allocator.stats().peak();
+}
+
+// reports the most bytes per element allocated beyond the start, and
+// the peak resident memory
+void report_memory(size_t n, size_t start) {
+  if (!global_mem_stats) return;
+  size_t peak = pbbs::default_allocator.stats().peak();
+  cout << "  memory: bytes/elt=" << (peak - std::min(peak, start)) / (double) n
+       << ", peak rss=" << (pbbs::peak_rss() >> 20) << "MB" << endl;
+}
 
 template<typename F>
 bool run_multiple(size_t n, size_t rounds, float bytes_per_elt,
 		  std::string name, F test, bool half_length=1, std::string x="bw") {
+  size_t mem_start = start_memory();
   std::vector<double> t = repeat(n, rounds, global_check, test);
 
   double mint = reduce(t, minf);
@@ -75,6 +119,8 @@ bool run_multiple(size_t n, size_t rounds, float bytes_per_elt,
        << "hlen=" << round(l) << ", "
        << x << " = " << bandwidth
        << endl;
+  report_memory(n, mem_start);
+  report_steals();
   return 1;
 }
 
@@ -169,6 +215,14 @@ double pick_test(size_t id, size_t n, size_t rounds,
     return run_multiple(n,rounds,ebytes(24,8),"scan add long seq", t_scan_add_seq<long>, half_length);
   case 52:
     return run_multiple(n,rounds,1, "range_min long", t_range_min<long>, half_length, "Gelts/sec");
+  case 53:
+    return run_multiple(n,rounds,ebytes(8,0)/25,"find early long", t_find_early<long>, half_length);
+  case 54:
+    return run_multiple(n,rounds,ebytes(16,8),"transpose long", t_transpose<long>, half_length);
+  case 55:
+    return run_multiple(n,rounds,ebytes(16,8),"stencil 3d double", t_stencil_3d, half_length);
+  case 56:
+    return run_multiple(n,rounds,ebytes(8,0),"reduce add long interleaved", t_reduce_add_interleaved<long>, half_length);
   default:
     assert(false);
     return 0.0 ;
@@ -177,12 +231,18 @@ double pick_test(size_t id, size_t n, size_t rounds,
 
 int main (int argc, char *argv[]) {
   commandLine P(argc, argv,
-		"[-n <size>] [-r <rounds>] [-halflen] [-t <testid>]");
+		"[-n <size>] [-r <rounds>] [-halflen] [-steals] [-schedstats] [-memstats] [-t <testid>]");
   size_t n = P.getOptionLongValue("-n", 100000000);
   int rounds = P.getOptionIntValue("-r", 5);
   int test_num = P.getOptionIntValue("-t", -1);
   bool half_length = P.getOption("-halflen");
   global_check = P.getOption("-check");
+  global_steals = P.getOption("-steals");
+  global_sched_stats = P.getOption("-schedstats");
+  global_mem_stats = P.getOption("-memstats");
+#if defined(HOMEGROWN)
+  if (global_sched_stats) fj.sched->enable_stats();
+#endif
   int num_tests = 33;
 
   cout << "n = " << n << endl;
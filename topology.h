@@ -0,0 +1,244 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <thread>
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+// The cache and memory topology of the machine, as used by the
+// scheduler to prefer nearby victims when stealing.
+// Each cpu belongs to an L3 domain (cpus sharing a last level cache)
+// and a numa node (cpus sharing a memory controller), each identified
+// by a small integer.  On Linux these are read from /sys.  Elsewhere,
+// or if /sys is not readable, all cpus are in one L3 domain and node.
+// Also supports pinning threads to cpus (Linux only).
+struct topology {
+
+  int num_cpus;
+  int num_nodes;
+  int num_l3;
+  std::vector<int> cpu_node;
+  std::vector<int> cpu_l3;
+  std::vector<int> allowed; // cpus the process could run on at startup
+
+  topology() {
+    num_cpus = std::max(1, (int) std::thread::hardware_concurrency());
+    num_nodes = num_l3 = 1;
+    cpu_node.assign(num_cpus, 0);
+    cpu_l3.assign(num_cpus, 0);
+    for (int c = 0; c < num_cpus; c++) allowed.push_back(c);
+#if defined(__linux__)
+    read_nodes();
+    read_l3();
+    read_allowed();
+#endif
+  }
+
+  // How to place workers on cpus:
+  //   none : not pinned, the OS decides
+  //   compact : consecutive workers on nearby cpus, filling an L3
+  //      domain and node before moving to the next
+  //   scatter : consecutive workers round robin across nodes
+  //   list : worker i on the i-th cpu of an explicit list
+  enum affinity_policy { none, compact, scatter, list };
+
+  // The cpu for each of n workers, empty if policy is none.
+  // Reserved cpus are left for other threads of the process, unless
+  // that would leave no cpus at all.
+  std::vector<int> placement(affinity_policy policy, int n,
+			     std::vector<int> const &reserved,
+			     std::vector<int> const &cpu_list = {}) {
+    std::vector<int> r;
+    if (policy == none || n <= 0) return r;
+    std::vector<int> avail;
+    for (int c : (policy == list) ? cpu_list : allowed)
+      if (std::find(reserved.begin(), reserved.end(), c) == reserved.end())
+	avail.push_back(c);
+    if (avail.empty()) avail = (policy == list) ? cpu_list : allowed;
+    if (avail.empty()) return r;
+    if (policy == compact)
+      std::stable_sort(avail.begin(), avail.end(), [&] (int a, int b) {
+	  return std::make_pair(node_of(a), l3_of(a)) <
+	    std::make_pair(node_of(b), l3_of(b));});
+    else if (policy == scatter) {
+      // interleave the nodes: i-th cpu of each node comes before the i+1-st
+      std::vector<int> rank(num_cpus, 0), count(num_nodes, 0);
+      for (int c : avail) if (node_of(c) >= 0) rank[c] = count[node_of(c)]++;
+      std::stable_sort(avail.begin(), avail.end(), [&] (int a, int b) {
+	  return std::make_pair(rank_of(rank, a), node_of(a)) <
+	    std::make_pair(rank_of(rank, b), node_of(b));});
+    }
+    for (int i = 0; i < n; i++) r.push_back(avail[i % avail.size()]);
+    return r;
+  }
+
+  // Parses a policy of the form "none", "compact", "scatter" or a cpu
+  // list such as "0-7,16-23", as used for PBBS_AFFINITY.
+  static affinity_policy parse_policy(std::string const &s,
+				      std::vector<int> &cpu_list) {
+    if (s == "" || s == "none") return none;
+    if (s == "compact") return compact;
+    if (s == "scatter") return scatter;
+    cpu_list = parse_cpu_list(s);
+    if (cpu_list.empty())
+      throw std::invalid_argument("unknown affinity policy: " + s);
+    return list;
+  }
+
+  // Restricts the calling thread to the given cpus.
+  // Returns false if not supported or it fails.
+  static bool pin_current_thread(std::vector<int> const &cpus) {
+#if defined(__linux__)
+    return pin_thread(pthread_self(), cpus);
+#else
+    return false;
+#endif
+  }
+
+  static bool pin_thread(std::thread &t, std::vector<int> const &cpus) {
+#if defined(__linux__)
+    return pin_thread(t.native_handle(), cpus);
+#else
+    return false;
+#endif
+  }
+
+#if defined(__linux__)
+  static bool pin_thread(pthread_t t, std::vector<int> const &cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : cpus) if (c >= 0 && c < CPU_SETSIZE) CPU_SET(c, &set);
+    return pthread_setaffinity_np(t, sizeof(set), &set) == 0;
+  }
+#endif
+
+  // cpu the calling thread is running on, or -1 if unknown
+  static int current_cpu() {
+#if defined(__linux__)
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+  }
+
+  int node_of(int cpu) {
+    return (cpu < 0 || cpu >= num_cpus) ? -1 : cpu_node[cpu];
+  }
+
+  int l3_of(int cpu) {
+    return (cpu < 0 || cpu >= num_cpus) ? -1 : cpu_l3[cpu];
+  }
+
+  // parses lists of the form "0-3,8,10-11"
+  static std::vector<int> parse_cpu_list(std::string const &s) {
+    std::vector<int> r;
+    size_t i = 0;
+    while (i < s.size()) {
+      if (!isdigit(s[i])) {i++; continue;}
+      size_t j;
+      int lo = std::stoi(s.substr(i), &j);
+      int hi = lo;
+      i += j;
+      if (i < s.size() && s[i] == '-') {
+	hi = std::stoi(s.substr(i+1), &j);
+	i += j + 1;
+      }
+      for (int c = lo; c <= hi; c++) r.push_back(c);
+    }
+    return r;
+  }
+
+private:
+
+  static int rank_of(std::vector<int> const &rank, int c) {
+    return (c < 0 || c >= (int) rank.size()) ? 0 : rank[c];
+  }
+
+  static bool read_line(std::string const &file, std::string &line) {
+    std::ifstream in(file);
+    return (bool) std::getline(in, line);
+  }
+
+  // assigns cpus to domains, where cpu_list[i] gives the cpus of domain i
+  int assign(std::vector<std::vector<int>> const &cpu_lists,
+	     std::vector<int> &domain) {
+    int d = 0;
+    for (auto &cpus : cpu_lists) {
+      bool used = false;
+      for (int c : cpus)
+	if (c < num_cpus) {domain[c] = d; used = true;}
+      if (used) d++;
+    }
+    return std::max(d, 1);
+  }
+
+#if defined(__linux__)
+  void read_nodes() {
+    DIR* dir = opendir("/sys/devices/system/node");
+    if (dir == NULL) return;
+    std::vector<std::vector<int>> cpu_lists;
+    while (struct dirent* e = readdir(dir)) {
+      std::string name(e->d_name);
+      if (name.compare(0, 4, "node") != 0 || name.size() == 4 ||
+	  !isdigit(name[4])) continue;
+      std::string line;
+      if (read_line("/sys/devices/system/node/" + name + "/cpulist", line))
+	cpu_lists.push_back(parse_cpu_list(line));
+    }
+    closedir(dir);
+    num_nodes = assign(cpu_lists, cpu_node);
+  }
+
+  // The last level cache is the highest level cache shared by
+  // several cpus, usually index3 but not always.  If no cache is
+  // shared, the highest level one.
+  void read_l3() {
+    std::vector<std::vector<int>> cpu_lists;
+    std::vector<bool> seen(num_cpus, false);
+    for (int c = 0; c < num_cpus; c++) {
+      if (seen[c]) continue;
+      std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(c) + "/cache/";
+      std::vector<int> best, top;
+      int best_level = 0, top_level = 0;
+      std::string line;
+      for (int i = 0; read_line(dir + "index" + std::to_string(i) + "/level", line); i++) {
+	int level = std::stoi(line);
+	std::string shared;
+	if (!read_line(dir + "index" + std::to_string(i) + "/shared_cpu_list", shared))
+	  continue;
+	std::vector<int> cpus = parse_cpu_list(shared);
+	if (level > top_level) {
+	  top_level = level;
+	  top = cpus;
+	}
+	if (cpus.size() > 1 && level > best_level) {
+	  best_level = level;
+	  best = cpus;
+	}
+      }
+      if (top_level == 0) return;
+      std::vector<int> cpus = (best_level > 0) ? best : top;
+      for (int x : cpus) if (x < num_cpus) seen[x] = true;
+      cpu_lists.push_back(cpus);
+    }
+    num_l3 = assign(cpu_lists, cpu_l3);
+  }
+
+  void read_allowed() {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return;
+    allowed.clear();
+    for (int c = 0; c < num_cpus && c < CPU_SETSIZE; c++)
+      if (CPU_ISSET(c, &set)) allowed.push_back(c);
+  }
+#endif
+};
@@ -28,99 +28,56 @@ namespace pbbs {
 
   constexpr const size_t TRANS_THRESHHOLD = PAR_GRANULARITY/4;
 
-  inline size_t split(size_t n) {
-    return n/2;
-    //return ((((size_t) 1) << log2_up(n) != n) ? n/2 : (7*(n+1))/16);
-  }
-
+  // Transposes the rCount x cCount matrix A into B, in cache oblivious
+  // tiles.
   template <class E>
   struct transpose {
     E *A, *B;
     transpose(E *AA, E *BB) : A(AA), B(BB) {}
 
-      void transR(size_t rStart, size_t rCount, size_t rLength,
-		  size_t cStart, size_t cCount, size_t cLength) {
-	if (cCount*rCount < TRANS_THRESHHOLD) {
-	  for (size_t i=rStart; i < rStart+ rCount; i++)
-	    for (size_t j=cStart; j < cStart + cCount; j++)
-	      B[j*cLength + i] = A[i*rLength + j];
-	} else if (cCount > rCount) {
-	  size_t l1 = split(cCount);
-	  size_t l2 = cCount - l1;
-	  auto left = [&] () {
-	    transR(rStart,rCount,rLength,cStart,l1,cLength);};
-	  auto right = [&] () {
-	    transR(rStart,rCount,rLength,cStart + l1,l2,cLength);};
-	  par_do(left, right);
-	} else {
-	  size_t l1 = split(cCount);
-	  size_t l2 = rCount - l1;
-	  auto left = [&] () {
-	    transR(rStart,l1,rLength,cStart,cCount,cLength);};
-	  auto right = [&] () {
-	    transR(rStart + l1,l2,rLength,cStart,cCount,cLength);};
-	  par_do(left, right);
-	}
-      }
-
-      void trans(size_t rCount, size_t cCount) {
+    void trans(size_t rCount, size_t cCount) {
 #if defined(OPENMP)
 #pragma omp parallel
 #pragma omp single
 #endif
-	transR(0,rCount,cCount,0,cCount,rCount);
-      }
-    };
+      parallel_for_2d(0, rCount, 0, cCount,
+		      [&] (size_t rs, size_t re, size_t cs, size_t ce) {
+	  for (size_t i=rs; i < re; i++)
+	    for (size_t j=cs; j < ce; j++)
+	      B[j*rCount + i] = A[i*cCount + j];
+	}, TRANS_THRESHHOLD);
+    }
+  };
 
+  // Transposes a matrix of blocks of varying size, where OA gives the
+  // offset of each block in A (row major) and OB in B (column major).
   template <class E, class int_t>
-    struct blockTrans {
-      E *A, *B;
-      int_t *OA, *OB;
+  struct blockTrans {
+    E *A, *B;
+    int_t *OA, *OB;
 
     blockTrans(E *AA, E *BB, int_t *OOA, int_t *OOB)
-    : A(AA), B(BB), OA(OOA), OB(OOB) {}
-
-      void transR(size_t rStart, size_t rCount, size_t rLength,
-		  size_t cStart, size_t cCount, size_t cLength) {
-	if (cCount*rCount < TRANS_THRESHHOLD*16) {
-	  parallel_for(rStart, rStart+rCount, [&] (size_t i) {
-	    for (size_t j=cStart; j < cStart + cCount; j++) {
-	      size_t sa = OA[i*rLength + j];
-	      size_t sb = OB[j*cLength + i];
-	      size_t l = OA[i*rLength + j + 1] - sa;
-	      for (size_t k =0; k < l; k++)
-		copy_memory(B[k+sb], A[k+sa]);
-	    }
-
-          });
-	} else if (cCount > rCount) {
-	  size_t l1 = split(cCount);
-	  size_t l2 = cCount - l1;
-	  auto left = [&] () {
-	    transR(rStart,rCount,rLength,cStart,l1,cLength);};
-	  auto right = [&] () {
-	    transR(rStart,rCount,rLength,cStart + l1,l2,cLength);};
-	  par_do(left, right);
-	} else {
-	  size_t l1 = split(cCount);
-	  size_t l2 = rCount - l1;
-	  auto left = [&] () {
-	    transR(rStart,l1,rLength,cStart,cCount,cLength);};
-	  auto right = [&] () {
-	    transR(rStart + l1,l2,rLength,cStart,cCount,cLength);};
-	  par_do(left, right);
-	}
-      }
+      : A(AA), B(BB), OA(OOA), OB(OOB) {}
 
-      void trans(size_t rCount, size_t cCount) {
+    void trans(size_t rCount, size_t cCount) {
 #if defined(OPENMP)
 #pragma omp parallel
 #pragma omp single
 #endif
-	transR(0,rCount,cCount,0,cCount,rCount);
-      }
-
-    } ;
+      parallel_for_2d(0, rCount, 0, cCount,
+		      [&] (size_t rs, size_t re, size_t cs, size_t ce) {
+	  parallel_for(rs, re, [&] (size_t i) {
+	      for (size_t j=cs; j < ce; j++) {
+		size_t sa = OA[i*cCount + j];
+		size_t sb = OB[j*rCount + i];
+		size_t l = OA[i*cCount + j + 1] - sa;
+		for (size_t k =0; k < l; k++)
+		  copy_memory(B[k+sb], A[k+sa]);
+	      }
+	    });
+	}, TRANS_THRESHHOLD*16);
+    }
+  };
 
   // Moves values from blocks to buckets
   // From is sorted by key within each block, in block major